@@ -0,0 +1,381 @@
+// Microbenchmarks of the loaders, the image writers, the rasterizer and whole frames.
+// Every benchmark runs a few warmup iterations, then the timed ones; the synthetic inputs come from fixed seeds so
+// that the runs are comparable. The results are printed to stderr and written as JSON to stdout (or to -json file).
+// Times include clearing the buffers the benchmark draws into.
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "image_writer.h"
+#include "model.h"
+#include "our_gl.h"
+#include "shaders.h"
+
+namespace fs = std::filesystem;
+
+constexpr int width  = 1024; // framebuffer size of the raster and frame benchmarks
+constexpr int height = 1024;
+
+struct Result {
+    std::string name;
+    int iterations;
+    double min, median, mean; // milliseconds per iteration
+    long long items;          // work done by one iteration, in unit
+    std::string unit;
+};
+
+struct {
+    int warmup = 2;
+    int iterations = 10;
+    std::string filter; // only run the benchmarks whose name contains it
+    std::vector<Result> results;
+} suite;
+
+template<class F>
+void bench(const std::string& name, const long long items, const std::string& unit, F&& fn) {
+    if (!suite.filter.empty() && name.find(suite.filter)==std::string::npos) return;
+    for (int i=0; i<suite.warmup; i++) fn();
+    std::vector<double> ms;
+    for (int i=0; i<suite.iterations; i++) {
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(ms.begin(), ms.end());
+    double sum = 0;
+    for (double t : ms) sum += t;
+    const Result r = {name, suite.iterations, ms.front(), ms[ms.size()/2], sum/ms.size(), items, unit};
+    suite.results.push_back(r);
+    std::clog << name << ": " << r.median << " ms (min " << r.min << "), " << items/r.median*1e3 << " " << unit << "/s" << std::endl;
+}
+
+// synthetic meshes, three clip-space vertices per face, w = 1 so that clip and normalized device coordinates match
+struct Mesh {
+    std::string name;
+    std::vector<vec4> verts;
+    int nfaces() const { return verts.size()/3; }
+};
+
+// vertex at pixel (x,y) of the framebuffer, z in [-1,1] (greater is closer)
+vec4 pixel(const real x, const real y, const real z) {
+    return {x*2/width - 1, y*2/height - 1, z, 1};
+}
+
+Mesh tiny_triangles(std::mt19937& rng) {
+    std::uniform_real_distribution<real> pos(0, width), off(-1.5, 1.5), depth(-1, 1);
+    Mesh m{"tiny", {}};
+    for (int i=0; i<200000; i++) {
+        const real x = pos(rng), y = pos(rng)*height/width, z = depth(rng);
+        for (int j=0; j<3; j++) m.verts.push_back(pixel(x+off(rng), y+off(rng), z));
+    }
+    return m;
+}
+
+// triangles much larger than the screen, they go through the guard band
+Mesh huge_triangles(std::mt19937& rng) {
+    std::uniform_real_distribution<real> pos(-2*width, 3*width), depth(-1, 1);
+    Mesh m{"huge", {}};
+    for (int i=0; i<64; i++) {
+        const real z = depth(rng);
+        for (int j=0; j<3; j++) m.verts.push_back(pixel(pos(rng), pos(rng)*height/width, z));
+    }
+    return m;
+}
+
+// full-screen quads stacked in random depth order
+Mesh overdraw(std::mt19937& rng) {
+    std::uniform_real_distribution<real> depth(-1, 1);
+    Mesh m{"overdraw", {}};
+    for (int i=0; i<32; i++) {
+        const real z = depth(rng);
+        const vec4 c[4] = {pixel(0, 0, z), pixel(width, 0, z), pixel(width, height, z), pixel(0, height, z)};
+        for (const vec4& v : {c[0], c[1], c[2], c[0], c[2], c[3]}) m.verts.push_back(v);
+    }
+    return m;
+}
+
+// long triangles less than a pixel wide, at random angles
+Mesh slivers(std::mt19937& rng) {
+    std::uniform_real_distribution<real> pos(0, width), angle(0, 6.2831853f), thickness(.1f, .8f), depth(-1, 1);
+    Mesh m{"sliver", {}};
+    for (int i=0; i<20000; i++) {
+        const real x = pos(rng), y = pos(rng)*height/width, a = angle(rng), t = thickness(rng), z = depth(rng);
+        const real dx = std::cos(a)*width/2, dy = std::sin(a)*height/2;
+        for (const vec4& v : {pixel(x, y, z), pixel(x+dx, y+dy, z), pixel(x+dx-dy/width*t, y+dy+dx/height*t, z)}) m.verts.push_back(v);
+    }
+    return m;
+}
+
+struct FlatShader {
+    struct Varyings {} varyings; // none
+    const vec4* verts;
+    vec4 vertex(int iface, int nthvert) { return verts[iface*3+nthvert]; }
+    bool fragment(vec3 bar, TGAColor& color) {
+        color = TGAColor(bar.x*255, bar.y*255, bar.z*255);
+        return false;
+    }
+};
+
+struct FlatIShader : IShader {
+    const vec4* verts;
+    explicit FlatIShader(const vec4* verts) : verts(verts) {}
+    vec4 vertex(int iface, int nthvert) override { return verts[iface*3+nthvert]; }
+    bool fragment(vec3 bar, TGAColor& color) override {
+        color = TGAColor(bar.x*255, bar.y*255, bar.z*255);
+        return false;
+    }
+};
+
+void raster_benchmarks(const DrawOptions& options) {
+    std::mt19937 rng(1);
+    RenderTarget target(width, height);
+    DepthBuffer zbuffer(width, height);
+    VisibilityBuffer vbuffer(width, height); // kept across the deferred draws like the depth buffer
+    DrawOptions opt = options;
+    opt.viewport = viewport(0, 0, width, height);
+    opt.cull = CullMode::None;
+    opt.vbuffer = &vbuffer;
+    for (const Mesh& mesh : {tiny_triangles(rng), huge_triangles(rng), overdraw(rng), slivers(rng)}) {
+        bench("raster/" + mesh.name + "/triangle", mesh.nfaces(), "triangles", [&]() {
+            zbuffer.clear();
+            FlatIShader shader(mesh.verts.data());
+            for (int i=0; i<mesh.nfaces(); i++) {
+                vec4 clip[3] = {shader.vertex(i, 0), shader.vertex(i, 1), shader.vertex(i, 2)};
+                triangle(clip, opt.viewport, shader, target, zbuffer, opt.cull);
+            }
+        });
+        for (ShadingMode mode : {ShadingMode::Forward, ShadingMode::Deferred}) {
+            opt.shading = mode;
+            bench("raster/" + mesh.name + (mode==ShadingMode::Forward ? "/draw" : "/draw_deferred"), mesh.nfaces(), "triangles", [&]() {
+                zbuffer.clear();
+                draw(mesh.nfaces(), FlatShader{{}, mesh.verts.data()}, target, zbuffer, opt);
+            });
+        }
+        std::vector<int> indices(mesh.verts.size());
+        for (size_t i=0; i<indices.size(); i++) indices[i] = i;
+        bench("raster/" + mesh.name + "/depth", mesh.nfaces(), "triangles", [&]() {
+            zbuffer.clear();
+            draw_depth(indices.data(), mesh.nfaces(), indices.size(), [&](int v) { return mesh.verts[v]; }, zbuffer, opt);
+        });
+    }
+}
+
+// a textured UV sphere, written as .obj with its diffuse texture
+void write_sphere(const std::string& objfile, const int rings, const int sectors) {
+    constexpr double pi = 3.14159265358979323846;
+    std::ofstream out(objfile);
+    for (int r=0; r<=rings; r++)
+        for (int s=0; s<=sectors; s++) {
+            const double theta = pi*r/rings, phi = 2*pi*s/sectors;
+            const double x = std::sin(theta)*std::cos(phi), y = std::cos(theta), z = std::sin(theta)*std::sin(phi);
+            out << "v " << x*.8 << " " << y*.8 << " " << z*.8 << "\nvt " << double(s)/sectors << " " << 1-double(r)/rings << "\nvn " << x << " " << y << " " << z << "\n";
+        }
+    for (int r=0; r<rings; r++)
+        for (int s=0; s<sectors; s++) {
+            const int a = r*(sectors+1) + s + 1, b = a + sectors + 1; // quads, split by the loader
+            out << "f " << a << "/" << a << "/" << a << " " << b << "/" << b << "/" << b << " "
+                << b+1 << "/" << b+1 << "/" << b+1 << " " << a+1 << "/" << a+1 << "/" << a+1 << "\n";
+        }
+}
+
+TGAImage test_image(const int w, const int h) {
+    TGAImage image(w, h, TGAImage::RGB);
+    std::mt19937 rng(2);
+    for (int y=0; y<h; y++)
+        for (int x=0; x<w; x++) {
+            // flat checkers with some noise, something between the best and the worst case of RLE
+            const bool checker = (x/64 + y/64)%2;
+            const std::uint8_t noise = (x/16)%3==0 ? rng()%32 : 0;
+            image.set(x, y, TGAColor(checker ? 200 : 40 + noise, x*255/w, y*255/h));
+        }
+    return image;
+}
+
+// normal map of the sphere: the object space normal at every uv, with a bumpy band around the equator
+TGAImage sphere_normals(const int w, const int h) {
+    constexpr double pi = 3.14159265358979323846;
+    TGAImage image(w, h, TGAImage::RGB);
+    for (int y=0; y<h; y++)
+        for (int x=0; x<w; x++) {
+            const double theta = pi*(1 - (y+.5)/h), phi = 2*pi*(x+.5)/w;
+            const double bump = std::abs(theta-pi/2)<.5 ? .3*std::sin(40*phi) : 0;
+            const double nx = std::sin(theta)*std::cos(phi+bump), ny = std::cos(theta), nz = std::sin(theta)*std::sin(phi+bump);
+            image.set(x, y, TGAColor((nz+1)*127.5, (ny+1)*127.5, (nx+1)*127.5));
+        }
+    return image;
+}
+
+// specular exponents from 0 to 255 across the texture
+TGAImage sphere_specular(const int w, const int h) {
+    TGAImage image(w, h, TGAImage::GRAYSCALE);
+    for (int y=0; y<h; y++)
+        for (int x=0; x<w; x++) image.set(x, y, TGAColor(x*255/(w-1), 0, 0));
+    return image;
+}
+
+void io_benchmarks(const fs::path& dir) {
+    const std::string objfile = (dir/"sphere.obj").string();
+    const long long objbytes = fs::file_size(objfile);
+    bench("load/obj", objbytes, "bytes", [&]() { Model model(objfile, false); });
+    { Model model(objfile, true); } // writes the cache
+    bench("load/trmesh", objbytes, "bytes", [&]() { Model model(objfile, true); });
+
+    const TGAImage image = test_image(2048, 2048);
+    const std::string tgafile = (dir/"image.tga").string();
+    bench("tga/encode", 2048*2048*3, "bytes", [&]() { image.encode_tga(); });
+    bench("tga/write", 2048*2048*3, "bytes", [&]() { image.write_tga_file(tgafile); });
+    bench("tga/read", 2048*2048*3, "bytes", [&]() { TGAImage img; img.read_tga_file(tgafile); });
+    const std::string qoifile = (dir/"image.qoi").string();
+    bench("qoi/encode", 2048*2048*3, "bytes", [&]() { encode_qoi(image); });
+    bench("qoi/write", 2048*2048*3, "bytes", [&]() { write_image(image, qoifile); });
+    // the streams are reopened every iteration so that the file holds one frame only
+    const std::string rawfile = (dir/"image.rgb").string();
+    bench("rgb/write", 2048*2048*3, "bytes", [&]() { make_image_writer(ImageFormat::RGB, rawfile)->write(image, ""); });
+    bench("rgba/write", 2048*2048*4, "bytes", [&]() { make_image_writer(ImageFormat::RGBA, rawfile)->write(image, ""); });
+    bench("rgb/mmap", 2048*2048*3, "bytes", [&]() { make_image_writer(ImageFormat::RGB, rawfile, true)->write(image, ""); });
+    std::clog << "file sizes: tga " << image.encode_tga().size() << ", qoi " << encode_qoi(image).size() << ", raw rgb "
+              << 2048*2048*3 << " bytes" << std::endl;
+
+    RenderTarget target(2048, 2048);
+    for (int y=0; y<2048; y++)
+        for (int x=0; x<2048; x++)
+            target.set(x, y, image.get(x, y));
+    TGAImage resolved(2048, 2048, TGAImage::RGB);
+    bench("target/resolve", 2048*2048, "pixels", [&]() { target.resolve(resolved); });
+}
+
+void frame_benchmarks(const fs::path& dir, const DrawOptions& options) {
+    const Model model((dir/"sphere.obj").string(), false);
+    const vec3 eye{1, 1, 3}, center{0, 0, 0}, light{1, 1, 1};
+    const mat<4,4> view_proj = projection(-1./(eye-center).norm())*lookat(eye, center, {0, 1, 0});
+    DrawOptions opt = options;
+    opt.viewport = viewport(width/8, height/8, width*3/4, height*3/4);
+    RenderTarget target(width, height);
+    DepthBuffer zbuffer(width, height);
+    auto frame = [&](const std::string& name, auto shader) {
+        bench("frame/" + name, model.nfaces(), "triangles", [&]() {
+            target.clear();
+            zbuffer.clear();
+            draw(model.nfaces(), shader, target, zbuffer, opt);
+        });
+    };
+    const Uniforms uniforms(view_proj, mat<4,4>::identity(), light);
+    frame("gouraud", GouraudShader(&model, uniforms));
+    frame("tex", TexShader(&model, uniforms));
+    PhongShader phong(&model, opt.viewport, view_proj, mat<4,4>::identity(), light);
+    phong.varyings.sampler.filter = Sampler::Bilinear;
+    frame("phong", phong);
+    decode_normal_maps = true;
+    const Model decoded((dir/"sphere.obj").string(), false);
+    decode_normal_maps = false;
+    phong.model = &decoded;
+    phong.fast_specular = true;
+    frame("phong_fast", phong);
+}
+
+// The fast shading path, with decoded normal maps and fast_pow(), against the exact one. fast_pow() alone stays within
+// one level; the decoded normals are filtered in floats where the exact path rounds the filtered texels to 8 bits, which
+// moves the sharpest highlights (exponents near 255 on the bumps) by a few levels.
+bool shading_checks(const fs::path& dir, const DrawOptions& options) {
+    constexpr int max_difference = 16;
+    constexpr double max_off_by_more_than_one = .02; // fraction of the covered pixels
+    constexpr real max_pow_error = 2e-3;
+    bool ok = true;
+
+    real pow_error = 0;
+    for (int e=0; e<256; e++)
+        for (int i=0; i<=4096; i++) {
+            const real x = i/4096.f;
+            pow_error = std::max(pow_error, std::abs(fast_pow(x, e) - std::pow(x, real(e))));
+        }
+    std::clog << "check fast_pow: max error " << pow_error << " (tolerance " << max_pow_error << ")" << std::endl;
+    ok = ok && pow_error<=max_pow_error;
+
+    const Model model((dir/"sphere.obj").string(), false);
+    decode_normal_maps = true;
+    const Model decoded((dir/"sphere.obj").string(), false);
+    decode_normal_maps = false;
+    DrawOptions opt = options;
+    opt.viewport = viewport(width/8, height/8, width*3/4, height*3/4);
+    for (const vec3 eye : {vec3{1, 1, 3}, vec3{-2, .5, 1}, vec3{.3, -2, -2}}) {
+        const mat<4,4> view_proj = projection(-1./eye.norm())*lookat(eye, {0, 0, 0}, {0, 1, 0});
+        TGAImage images[2];
+        for (int fast : {0, 1}) {
+            PhongShader shader(fast ? &decoded : &model, opt.viewport, view_proj, mat<4,4>::identity(), {1, 1, 1});
+            shader.varyings.sampler.filter = Sampler::Bilinear;
+            shader.fast_specular = fast;
+            RenderTarget target(width, height);
+            DepthBuffer zbuffer(width, height);
+            draw(model.nfaces(), shader, target, zbuffer, opt);
+            target.resolve(images[fast]);
+        }
+        int worst = 0;
+        long long covered = 0, off = 0;
+        for (int y=0; y<height; y++)
+            for (int x=0; x<width; x++) {
+                const TGAColor a = images[0].get(x, y), b = images[1].get(x, y);
+                int d = 0;
+                for (int i=0; i<3; i++) d = std::max(d, std::abs(a.bgra[i] - b.bgra[i]));
+                covered += a.bgra[0] || a.bgra[1] || a.bgra[2];
+                off += d>1;
+                worst = std::max(worst, d);
+            }
+        std::clog << "check phong_fast from (" << eye << "): max difference " << worst << ", " << off << " of " << covered
+                  << " pixels off by more than one level" << std::endl;
+        ok = ok && worst<=max_difference && off<=max_off_by_more_than_one*covered;
+    }
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    const char* json = nullptr;
+    DrawOptions options;
+    for (int i=1; i<argc; i++) {
+        if (!strcmp(argv[i], "-t") && i+1<argc) options.nthreads = render_threads = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-iterations") && i+1<argc) suite.iterations = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-warmup") && i+1<argc) suite.warmup = std::max(0, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-filter") && i+1<argc) suite.filter = argv[++i];
+        else if (!strcmp(argv[i], "-json") && i+1<argc) json = argv[++i];
+        else {
+            std::clog << "usage: " << argv[0] << " [-t threads] [-iterations n] [-warmup n] [-filter substring] [-json file]" << std::endl;
+            return 1;
+        }
+    }
+
+    const fs::path dir = fs::temp_directory_path() / ("tinyrenderer_bench_" + std::to_string(std::random_device{}()));
+    fs::create_directories(dir);
+    std::cerr.rdbuf(nullptr); // silences the messages of the loaders, the results go to std::clog
+
+    write_sphere((dir/"sphere.obj").string(), 400, 800);
+    test_image(2048, 2048).write_tga_file((dir/"sphere_diffuse.tga").string());
+    sphere_normals(1024, 512).write_tga_file((dir/"sphere_nm_tangent.tga").string());
+    sphere_specular(1024, 512).write_tga_file((dir/"sphere_spec.tga").string());
+
+    raster_benchmarks(options);
+    io_benchmarks(dir);
+    frame_benchmarks(dir, options);
+    const bool checked = shading_checks(dir, options);
+    fs::remove_all(dir);
+
+    std::ofstream file;
+    if (json) file.open(json);
+    std::ostream& out = json ? file : std::cout;
+    out << "{\n  \"threads\": " << options.nthreads << ",\n  \"simd\": \"" << simd_name(simd_level()) << "\",\n  \"real\": \""
+        << (sizeof(real)==sizeof(float) ? "float" : "double") << "\",\n  \"warmup\": " << suite.warmup << ",\n  \"benchmarks\": [\n";
+    for (size_t i=0; i<suite.results.size(); i++) {
+        const Result& r = suite.results[i];
+        out << "    {\"name\": \"" << r.name << "\", \"iterations\": " << r.iterations << ", \"min_ms\": " << r.min << ", \"median_ms\": "
+            << r.median << ", \"mean_ms\": " << r.mean << ", \"items\": " << r.items << ", \"unit\": \"" << r.unit << "\", \"per_second\": "
+            << r.items/r.median*1e3 << "}" << (i+1<suite.results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    if (!checked) std::clog << "the fast shading path is out of tolerance" << std::endl;
+    return checked ? 0 : 1;
+}
@@ -0,0 +1,51 @@
+#include "frame_writer.h"
+#include "profile.h"
+
+FrameWriter::FrameWriter(std::unique_ptr<ImageWriter> output) : output(std::move(output)), worker(&FrameWriter::run, this) {}
+
+FrameWriter::~FrameWriter() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this]() { return !busy; });
+        stop = true;
+    }
+    cond.notify_all();
+    worker.join();
+}
+
+void FrameWriter::submit(TGAImage& frame, const std::string& name) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this]() { return !busy; });
+    if (pending.width()!=frame.width() || pending.height()!=frame.height() || pending.bytespp()!=frame.bytespp())
+        pending = TGAImage(frame.width(), frame.height(), frame.bytespp());
+    std::swap(pending, frame);
+    filename = name;
+    busy = true;
+    lock.unlock();
+    cond.notify_all();
+}
+
+bool FrameWriter::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this]() { return !busy; });
+    return ok;
+}
+
+void FrameWriter::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cond.wait(lock, [this]() { return busy || stop; });
+        if (!busy) return;
+        lock.unlock();
+        bool written;
+        {
+            PROFILE_SCOPE(Output, profile::writer_track);
+            written = output->write(pending, filename);
+            pending.clear();
+        }
+        lock.lock();
+        ok = ok && written;
+        busy = false;
+        cond.notify_all();
+    }
+}
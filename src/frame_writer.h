@@ -0,0 +1,39 @@
+#ifndef FRAME_WRITER_H
+#define FRAME_WRITER_H
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "tgaimage.h"
+#include "image_writer.h"
+
+// Writes frames on a background thread, to .tga files unless another ImageWriter is given. The renderer and the writer
+// share two framebuffers: submit() hands the rendered frame over and gives back the other one, cleared, so that the
+// next frame is rendered while the previous one is encoded and written.
+class FrameWriter {
+public:
+    explicit FrameWriter(std::unique_ptr<ImageWriter> output=make_image_writer(ImageFormat::TGA));
+    ~FrameWriter(); // writes the pending frame
+    FrameWriter(const FrameWriter&) = delete;
+    FrameWriter& operator=(const FrameWriter&) = delete;
+
+    // waits for the previous frame to be written, then swaps frame with a cleared framebuffer of the same size
+    void submit(TGAImage& frame, const std::string& filename);
+    // waits for the pending frame, returns false if any write has failed so far
+    bool wait();
+private:
+    void run();
+
+    std::unique_ptr<ImageWriter> output;
+    std::mutex mutex;
+    std::condition_variable cond;
+    TGAImage pending;      // frame being written, then cleared and handed back by the next submit()
+    std::string filename;
+    bool busy = false;
+    bool stop = false;
+    bool ok = true;
+    std::thread worker;
+};
+
+#endif
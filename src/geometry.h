@@ -5,52 +5,63 @@
 #include <cassert>
 #include <iostream>
 
+// scalar type of all vectors and matrices, float unless the build asks for double precision
+#ifdef TINYRENDERER_DOUBLE
+typedef double real;
+#else
+typedef float real;
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=1)
+#define GEOMETRY_SSE
+#include <xmmintrin.h>
+#endif
+#endif
+
 template <int n>
 struct vec {
-    double data[n] = { 0 };
-    double& operator[](const int i) { assert(0<=i && i<n); return data[i]; }
-    double operator[](const int i) const { assert(0<=i && i<n); return data[i]; }
-    double norm() const { return std::sqrt(norm2()); }
-    double norm2() const { return (*this) * (*this); }
+    real data[n] = { 0 };
+    constexpr real& operator[](const int i) { assert(0<=i && i<n); return data[i]; }
+    constexpr real operator[](const int i) const { assert(0<=i && i<n); return data[i]; }
+    real norm() const { return std::sqrt(norm2()); }
+    constexpr real norm2() const { return (*this) * (*this); }
     vec<n> normalized() const { return (*this)/norm(); }
 };
 
 template <int n>
-vec<n> operator+(const vec<n>& lhs, const vec<n>& rhs) {
+constexpr vec<n> operator+(const vec<n>& lhs, const vec<n>& rhs) {
     vec<n> ret = lhs;
     for(int i=n; i--; ret[i]+=rhs[i]);
     return ret;
 }
 
 template <int n>
-vec<n> operator-(const vec<n>& lhs, const vec<n>& rhs) {
+constexpr vec<n> operator-(const vec<n>& lhs, const vec<n>& rhs) {
     vec<n> ret = lhs;
     for(int i=n; i--; ret[i]-=rhs[i]);
     return ret;
 }
 
 template <int n>
-double operator*(const vec<n>& lhs, const vec<n>& rhs) {
+constexpr real operator*(const vec<n>& lhs, const vec<n>& rhs) {
     // dot product
-    double ret = 0;
+    real ret = 0;
     for(int i=n; i--; ret+= lhs[i]*rhs[i]);
     return ret;
 }
 
 template <int n>
-vec<n> operator*(const double& lhs, const vec<n>& rhs) {
+constexpr vec<n> operator*(const real& lhs, const vec<n>& rhs) {
     vec<n> ret = rhs;
     for(int i=n; i--; ret[i]*=lhs );
     return ret;
 }
 
 template <int n>
-vec<n> operator*(const vec<n>& lhs, const double& rhs) {
+constexpr vec<n> operator*(const vec<n>& lhs, const real& rhs) {
     return rhs * lhs;
 }
 
 template <int n>
-vec<n> operator/(const vec<n>& lhs, const double& rhs) {
+constexpr vec<n> operator/(const vec<n>& lhs, const real& rhs) {
     assert(rhs != 0);
     vec<n> ret = lhs;
     for(int i=n; i--; ret[i]/=rhs);
@@ -58,14 +69,14 @@ vec<n> operator/(const vec<n>& lhs, const double& rhs) {
 }
 
 template <int n1, int n2>
-vec<n1> embed(const vec<n2>& v, double fill=1) {
+constexpr vec<n1> embed(const vec<n2>& v, real fill=1) {
     vec<n1> ret;
     for(int i=n1; i--; ret[i] = (i<n2 ? v[i] : fill));
     return ret;
 }
 
 template <int n1, int n2>
-vec<n1> proj(const vec<n2>& v) {
+constexpr vec<n1> proj(const vec<n2>& v) {
     vec<n1> ret;
     for(int i=n1; i--; ret[i]=v[i]);
     return ret;
@@ -77,73 +88,95 @@ std::ostream& operator<<(std::ostream& out, const vec<n>& v) {
     return out;
 }
 
+// named components are indexed through a table of member pointers, which needs no branches
 template <>
 struct vec<2>
 {
-    double x=0, y=0;
-    double& operator[](const int i) { assert(0<=i && i<2); return (i ? y : x); }
-    double operator[](const int i) const { assert(0<=i && i<2); return (i ? y : x); }
-    double norm() const { return std::sqrt(norm2()); }
-    double norm2() const { return (*this) * (*this); }
+    real x=0, y=0;
+    constexpr real& operator[](const int i);
+    constexpr real operator[](const int i) const;
+    real norm() const { return std::sqrt(norm2()); }
+    constexpr real norm2() const { return (*this) * (*this); }
     vec<2> normalized() const { return (*this)/norm(); }
 };
 
+inline constexpr real vec<2>::* vec2_members[2] = {&vec<2>::x, &vec<2>::y};
+constexpr real& vec<2>::operator[](const int i) { assert(0<=i && i<2); return this->*vec2_members[i]; }
+constexpr real vec<2>::operator[](const int i) const { assert(0<=i && i<2); return this->*vec2_members[i]; }
+
 template <>
 struct vec<3>
 {
-    double x=0, y=0, z=0;
-    double& operator[](const int i) { assert(0<=i && i<3); return (i ? (i==1 ? y : z) : x); }
-    double operator[](const int i) const { assert(0<=i && i<3); return (i ? (i==1 ? y : z) : x); }
-    double norm() const { return std::sqrt(norm2()); }
-    double norm2() const { return (*this) * (*this); }
+    real x=0, y=0, z=0;
+    constexpr real& operator[](const int i);
+    constexpr real operator[](const int i) const;
+    real norm() const { return std::sqrt(norm2()); }
+    constexpr real norm2() const { return (*this) * (*this); }
     vec<3> normalized() const { return (*this)/norm(); }
 };
 
+inline constexpr real vec<3>::* vec3_members[3] = {&vec<3>::x, &vec<3>::y, &vec<3>::z};
+constexpr real& vec<3>::operator[](const int i) { assert(0<=i && i<3); return this->*vec3_members[i]; }
+constexpr real vec<3>::operator[](const int i) const { assert(0<=i && i<3); return this->*vec3_members[i]; }
+
+// aligned so that a vec4 (and a row of a mat<4,4>) fits a SIMD register
+template <>
+struct alignas(4*sizeof(real)) vec<4>
+{
+    real data[4] = { 0 };
+    constexpr real& operator[](const int i) { assert(0<=i && i<4); return data[i]; }
+    constexpr real operator[](const int i) const { assert(0<=i && i<4); return data[i]; }
+    real norm() const { return std::sqrt(norm2()); }
+    constexpr real norm2() const { return (*this) * (*this); }
+    vec<4> normalized() const { return (*this)/norm(); }
+};
+
 typedef vec<2> vec2;
 typedef vec<3> vec3;
 typedef vec<4> vec4;
 
-inline vec3 cross(const vec3& v1, const vec3& v2) {
+constexpr vec3 cross(const vec3& v1, const vec3& v2) {
     return vec3{v1.y*v2.z - v1.z*v2.y, v1.z*v2.x - v1.x*v2.z, v1.x*v2.y - v1.y*v2.x};
 }
 
 template<int n> struct dt;
+template<int n> struct invt;
 
 template<int r, int c> struct mat {
     // initialize to zero array
     vec<c> rows[r] = { {} };
 
     // setters/getters for rows and cols (operator[] for rows, methods for cols)
-    vec<c>& operator[](const int i) { assert(0<=i && i<r); return rows[i]; }
-    const vec<c>& operator[](const int i) const { assert(0<=i && i<r); return rows[i]; }
+    constexpr vec<c>& operator[](const int i) { assert(0<=i && i<r); return rows[i]; }
+    constexpr const vec<c>& operator[](const int i) const { assert(0<=i && i<r); return rows[i]; }
 
-    vec<r> col(const int i) const {
+    constexpr vec<r> col(const int i) const {
         assert(0<=i && i<c);
         vec<r> ret;
         for(int j=r; j--; ret[j] = rows[j][i]);
         return ret;
     }
 
-    void set_col(const int i, vec<r>& v) {
+    constexpr void set_col(const int i, const vec<r>& v) {
         assert(0<=i && i<c);
         for(int j=r; j--; rows[j][i] = v[j] );
     }
 
     // return identity matrix
-    static mat<r, c> identity() {
+    static constexpr mat<r, c> identity() {
         assert(r==c);
         mat<r,c> ret;
         for(int i=r; i--; ) for(int j=c; j--; ret[i][j]=(i==j));
         return ret;
     }
-    
+
     // determinant
-    double det() const {
+    constexpr real det() const {
         return dt<c>::det(*this);
     }
 
     // get_minor
-    mat<r-1, c-1> get_minor(const int row, const int col) const {
+    constexpr mat<r-1, c-1> get_minor(const int row, const int col) const {
         mat<r-1, c-1> ret;
         for (int i = 0; i < r - 1; i++)
             for (int j = 0; j < c - 1; j++)
@@ -152,30 +185,29 @@ template<int r, int c> struct mat {
     }
 
     // get cofactor
-    double cofactor(const int i, const int j) const {
+    constexpr real cofactor(const int i, const int j) const {
         return get_minor(i, j).det() * ((i + j) % 2 ? -1 : 1);
-    } 
+    }
 
     // get adjugate matrix
-    mat<r, c> adjugate() const {
+    constexpr mat<r, c> adjugate() const {
         mat<r, c> ret;
         for(int i=r; i--; ) for(int j=c; j--; ret[i][j] = cofactor(i, j));
         return ret;
     }
 
     // get inverse transpose
-    mat<r, c> inverse_transpose() const {
-        mat<r, c> adj = adjugate();
-        return adj / (adj[0] * rows[0]);
+    constexpr mat<r, c> inverse_transpose() const {
+        return invt<c>::inverse_transpose(*this);
     }
 
     // get inverse
-    mat<r, c> inverse() const {
+    constexpr mat<r, c> inverse() const {
         return inverse_transpose().transpose();
     }
 
     // get transpose
-    mat<c, r> transpose() const {
+    constexpr mat<c, r> transpose() const {
         mat<c, r> ret;
         for(int i=c; i--; ret[i] = this->col(i));
         return ret;
@@ -183,14 +215,14 @@ template<int r, int c> struct mat {
 };
 
 template<int r, int c>
-mat<r, c> operator+(const mat<r,c>& lhs, const mat<r,c>& rhs) {
+constexpr mat<r, c> operator+(const mat<r,c>& lhs, const mat<r,c>& rhs) {
     mat<r, c> ret;
     for(int i=r; i--; ) for(int j=c; j--; ret[i][j] = lhs[i][j] + rhs[i][j]);
     return ret;
 }
 
 template<int r, int c>
-mat<r, c> operator-(const mat<r,c>& lhs, const mat<r,c>& rhs) {
+constexpr mat<r, c> operator-(const mat<r,c>& lhs, const mat<r,c>& rhs) {
     mat<r, c> ret;
     for(int i=r; i--; ) for(int j=c; j--; ret[i][j] = lhs[i][j] - rhs[i][j]);
     return ret;
@@ -198,33 +230,61 @@ mat<r, c> operator-(const mat<r,c>& lhs, const mat<r,c>& rhs) {
 
 // matrix-vector, matrix-matrix, and scalar-matrix multiplications
 template<int r, int c>
-vec<r> operator*(const mat<r,c>& lhs, const vec<c>& rhs) {
+constexpr vec<r> operator*(const mat<r,c>& lhs, const vec<c>& rhs) {
     vec<r> ret;
     for(int i=r; i--; ret[i] = lhs[i] * rhs);
     return ret;
 }
 
 template<int l, int m, int n>
-mat<l, n> operator*(const mat<l, m>& lhs, const mat<m, n>& rhs) {
+constexpr mat<l, n> operator*(const mat<l, m>& lhs, const mat<m, n>& rhs) {
     mat<l, n> ret;
     for(int i=l; i--; ) for(int j=n; j--; ret[i][j] = lhs[i]*rhs.col(j));
     return ret;
 }
 
+#ifdef GEOMETRY_SSE
+// 4x4 transforms: the products with the rows are transposed so that four dot products take three additions
+inline vec4 operator*(const mat<4,4>& lhs, const vec4& rhs) {
+    __m128 v  = _mm_load_ps(rhs.data);
+    __m128 r0 = _mm_mul_ps(_mm_load_ps(lhs[0].data), v);
+    __m128 r1 = _mm_mul_ps(_mm_load_ps(lhs[1].data), v);
+    __m128 r2 = _mm_mul_ps(_mm_load_ps(lhs[2].data), v);
+    __m128 r3 = _mm_mul_ps(_mm_load_ps(lhs[3].data), v);
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    vec4 ret;
+    _mm_store_ps(ret.data, _mm_add_ps(_mm_add_ps(r0, r1), _mm_add_ps(r2, r3)));
+    return ret;
+}
+
+// every row of the product is a combination of the rows of rhs
+inline mat<4,4> operator*(const mat<4,4>& lhs, const mat<4,4>& rhs) {
+    __m128 b[4];
+    for (int k=0; k<4; k++) b[k] = _mm_load_ps(rhs[k].data);
+    mat<4,4> ret;
+    for (int i=0; i<4; i++) {
+        __m128 row = _mm_mul_ps(_mm_set1_ps(lhs[i][0]), b[0]);
+        for (int k=1; k<4; k++) row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(lhs[i][k]), b[k]));
+        _mm_store_ps(ret[i].data, row);
+    }
+    return ret;
+}
+#endif
+
 template<int r, int c>
-mat<r, c> operator*(const mat<r, c>& lhs, const double val) {
+constexpr mat<r, c> operator*(const mat<r, c>& lhs, const real val) {
     mat<r, c> ret;
     for(int i=r; i--; ret[i] = lhs[i]*val );
     return ret;
 }
 
 template<int r, int c>
-mat<r, c> operator*(const double val, const mat<r, c>& rhs) {
+constexpr mat<r, c> operator*(const real val, const mat<r, c>& rhs) {
     return rhs*val;
 }
 
 template<int r, int c>
-mat<r, c> operator/(const mat<r, c>& lhs, const double val) {
+constexpr mat<r, c> operator/(const mat<r, c>& lhs, const real val) {
     assert(val != 0);
     return lhs * (1/val);
 }
@@ -236,17 +296,80 @@ std::ostream& operator<<(std::ostream& os, const mat<r, c>& m) {
 }
 
 template<int n> struct dt {
-    static double det(const mat<n,n>& src) {
-        double ret = 0;
+    static constexpr real det(const mat<n,n>& src) {
+        real ret = 0;
         for (int i=n; i--; ret += src[0][i]*src.cofactor(0,i));
         return ret;
     }
 };
 
 template<> struct dt<1> {
-    static double det(const mat<1,1>& src) {
+    static constexpr real det(const mat<1,1>& src) {
         return src[0][0];
     }
 };
 
-#endif
\ No newline at end of file
+// closed forms for the sizes the renderer actually uses
+template<> struct dt<2> {
+    static constexpr real det(const mat<2,2>& m) {
+        return m[0][0]*m[1][1] - m[0][1]*m[1][0];
+    }
+};
+
+template<> struct dt<3> {
+    static constexpr real det(const mat<3,3>& m) {
+        return m[0]*cross(m[1], m[2]);
+    }
+};
+
+// 2x2 minors of the upper (s) and lower (c) halves of a 4x4 matrix
+struct minors4 {
+    real s[6], c[6];
+    constexpr minors4(const mat<4,4>& m) :
+        s{m[0][0]*m[1][1] - m[1][0]*m[0][1], m[0][0]*m[1][2] - m[1][0]*m[0][2], m[0][0]*m[1][3] - m[1][0]*m[0][3],
+          m[0][1]*m[1][2] - m[1][1]*m[0][2], m[0][1]*m[1][3] - m[1][1]*m[0][3], m[0][2]*m[1][3] - m[1][2]*m[0][3]},
+        c{m[2][0]*m[3][1] - m[3][0]*m[2][1], m[2][0]*m[3][2] - m[3][0]*m[2][2], m[2][0]*m[3][3] - m[3][0]*m[2][3],
+          m[2][1]*m[3][2] - m[3][1]*m[2][2], m[2][1]*m[3][3] - m[3][1]*m[2][3], m[2][2]*m[3][3] - m[3][2]*m[2][3]} {}
+    constexpr real det() const {
+        return s[0]*c[5] - s[1]*c[4] + s[2]*c[3] + s[3]*c[2] - s[4]*c[1] + s[5]*c[0];
+    }
+};
+
+template<> struct dt<4> {
+    static constexpr real det(const mat<4,4>& m) {
+        return minors4(m).det();
+    }
+};
+
+template<int n> struct invt {
+    static constexpr mat<n,n> inverse_transpose(const mat<n,n>& m) {
+        mat<n,n> adj = m.adjugate();
+        return adj / (adj[0] * m[0]);
+    }
+};
+
+template<> struct invt<3> {
+    // the cofactor matrix of a 3x3 matrix is made of the cross products of its rows
+    static constexpr mat<3,3> inverse_transpose(const mat<3,3>& m) {
+        mat<3,3> cof = {{cross(m[1], m[2]), cross(m[2], m[0]), cross(m[0], m[1])}};
+        return cof / (cof[0] * m[0]);
+    }
+};
+
+template<> struct invt<4> {
+    static constexpr mat<4,4> inverse_transpose(const mat<4,4>& m) {
+        const minors4 k(m);
+        const real* s = k.s;
+        const real* c = k.c;
+        // transposed adjugate, i.e. the cofactor matrix
+        mat<4,4> cof = {{
+            { m[1][1]*c[5] - m[1][2]*c[4] + m[1][3]*c[3], -m[1][0]*c[5] + m[1][2]*c[2] - m[1][3]*c[1],  m[1][0]*c[4] - m[1][1]*c[2] + m[1][3]*c[0], -m[1][0]*c[3] + m[1][1]*c[1] - m[1][2]*c[0]},
+            {-m[0][1]*c[5] + m[0][2]*c[4] - m[0][3]*c[3],  m[0][0]*c[5] - m[0][2]*c[2] + m[0][3]*c[1], -m[0][0]*c[4] + m[0][1]*c[2] - m[0][3]*c[0],  m[0][0]*c[3] - m[0][1]*c[1] + m[0][2]*c[0]},
+            { m[3][1]*s[5] - m[3][2]*s[4] + m[3][3]*s[3], -m[3][0]*s[5] + m[3][2]*s[2] - m[3][3]*s[1],  m[3][0]*s[4] - m[3][1]*s[2] + m[3][3]*s[0], -m[3][0]*s[3] + m[3][1]*s[1] - m[3][2]*s[0]},
+            {-m[2][1]*s[5] + m[2][2]*s[4] - m[2][3]*s[3],  m[2][0]*s[5] - m[2][2]*s[2] + m[2][3]*s[1], -m[2][0]*s[4] + m[2][1]*s[2] - m[2][3]*s[0],  m[2][0]*s[3] - m[2][1]*s[1] + m[2][2]*s[0]}
+        }};
+        return cof / k.det();
+    }
+};
+
+#endif
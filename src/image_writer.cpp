@@ -0,0 +1,236 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include "image_writer.h"
+#include "parallel.h"
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+bool parse_image_format(const char* name, ImageFormat& format) {
+    if (!std::strcmp(name, "tga")) format = ImageFormat::TGA;
+    else if (!std::strcmp(name, "qoi")) format = ImageFormat::QOI;
+    else if (!std::strcmp(name, "rgb")) format = ImageFormat::RGB;
+    else if (!std::strcmp(name, "rgba")) format = ImageFormat::RGBA;
+    else return false;
+    return true;
+}
+
+ImageFormat image_format(const std::string& filename) {
+    const size_t dot = filename.rfind('.');
+    if (dot==std::string::npos) return ImageFormat::TGA;
+    ImageFormat format;
+    if (!parse_image_format(filename.c_str()+dot+1, format)) return ImageFormat::TGA;
+    return format;
+}
+
+const char* image_extension(const ImageFormat format) {
+    switch (format) {
+        case ImageFormat::QOI:  return "qoi";
+        case ImageFormat::RGB:  return "rgb";
+        case ImageFormat::RGBA: return "rgba";
+        default:                return "tga";
+    }
+}
+
+namespace {
+    // the images are stored bottom row first (see TGAImage::write_tga_file), the other formats start with the top one
+    const std::uint8_t* top_down_row(const TGAImage& image, const int y) {
+        return image.buffer() + size_t(image.height()-1-y)*image.width()*image.bytespp();
+    }
+
+    // one row of b,g,r(,a) or gray bytes to r,g,b(,a)
+    void convert_row(const TGAImage& image, const int y, const int channels, std::uint8_t* out) {
+        const std::uint8_t* in = top_down_row(image, y);
+        const int w = image.width(), bpp = image.bytespp();
+        for (int x=0; x<w; x++, in+=bpp, out+=channels) {
+            const bool gray = bpp==TGAImage::GRAYSCALE;
+            out[0] = in[gray ? 0 : 2];
+            out[1] = in[gray ? 0 : 1];
+            out[2] = in[0];
+            if (channels==4) out[3] = bpp==TGAImage::RGBA ? in[3] : 255;
+        }
+    }
+
+    // the whole frame, rows converted in parallel
+    void convert(const TGAImage& image, const int channels, std::uint8_t* out) {
+        const size_t stride = size_t(image.width())*channels;
+        parallel_chunks(image.height(), std::min(num_threads(), std::max(1, image.height()/64)), [&](int begin, int end, int) {
+            for (int y=begin; y<end; y++) convert_row(image, y, channels, out + y*stride);
+        });
+    }
+
+    bool write_file(const std::vector<std::uint8_t>& data, const std::string& filename) {
+        std::ofstream out(filename, std::ios::binary);
+        if (!out.is_open()) {
+            std::cerr << "can't open file " << filename << "\n";
+            return false;
+        }
+        out.write(reinterpret_cast<const char *>(data.data()), data.size());
+        if (!out.good()) {
+            std::cerr << "can't write the file " << filename << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    struct FileWriter : ImageWriter {
+        ImageFormat format;
+        explicit FileWriter(const ImageFormat format) : format(format) {}
+        bool write(const TGAImage& image, const std::string& filename) override {
+            return format==ImageFormat::QOI ? write_file(encode_qoi(image), filename) : image.write_tga_file(filename);
+        }
+    };
+
+    // raw frames appended to a stream
+    struct StreamWriter : ImageWriter {
+        std::FILE* out;
+        bool owned;
+        int channels;
+        std::vector<std::uint8_t> frame;
+
+        StreamWriter(std::FILE* out, const bool owned, const int channels) : out(out), owned(owned), channels(channels) {}
+        ~StreamWriter() override {
+            if (owned) std::fclose(out);
+            else std::fflush(out);
+        }
+
+        bool write(const TGAImage& image, const std::string&) override {
+            frame.resize(size_t(image.width())*image.height()*channels);
+            convert(image, channels, frame.data());
+            if (std::fwrite(frame.data(), 1, frame.size(), out)!=frame.size()) {
+                std::cerr << "can't write the frame to the stream\n";
+                return false;
+            }
+            return true;
+        }
+    };
+
+#if defined(__unix__) || defined(__APPLE__)
+    // raw frames appended to a file that grows by one frame at a time, each frame is converted into its mapping
+    struct MappedWriter : ImageWriter {
+        int fd;
+        int channels;
+        off_t offset = 0; // end of the frames written so far
+
+        MappedWriter(const int fd, const int channels) : fd(fd), channels(channels) {}
+        ~MappedWriter() override { ::close(fd); }
+
+        bool write(const TGAImage& image, const std::string&) override {
+            const size_t size = size_t(image.width())*image.height()*channels;
+            if (!size) return true;
+            if (ftruncate(fd, offset + size)) {
+                std::cerr << "can't extend the output file\n";
+                return false;
+            }
+            // mappings start on a page boundary, the frames don't
+            const off_t start = offset - offset % sysconf(_SC_PAGESIZE);
+            const size_t length = size + (offset - start);
+            void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, start);
+            if (p==MAP_FAILED) {
+                std::cerr << "can't map the output file\n";
+                return false;
+            }
+            convert(image, channels, static_cast<std::uint8_t*>(p) + (offset - start));
+            munmap(p, length);
+            offset += size;
+            return true;
+        }
+    };
+#endif
+}
+
+std::vector<std::uint8_t> encode_qoi(const TGAImage& image) {
+    const int w = image.width(), h = image.height();
+    const int channels = image.bytespp()==TGAImage::RGBA ? 4 : 3;
+    constexpr std::uint8_t op_index = 0x00, op_diff = 0x40, op_luma = 0x80, op_run = 0xc0, op_rgb = 0xfe, op_rgba = 0xff;
+    constexpr std::uint8_t padding[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    // header, then at most one byte more than the pixel itself per pixel, then the end marker
+    std::vector<std::uint8_t> out(14 + size_t(w)*h*(channels+1) + sizeof(padding));
+    std::uint8_t* p = out.data();
+    auto u32 = [&p](const std::uint32_t v) { for (int s=24; s>=0; s-=8) *p++ = v>>s; };
+    *p++ = 'q'; *p++ = 'o'; *p++ = 'i'; *p++ = 'f';
+    u32(w);
+    u32(h);
+    *p++ = channels;
+    *p++ = 0; // sRGB with linear alpha
+
+    std::uint32_t index[64] = {}; // previously seen pixels, r,g,b,a from the low byte up
+    std::uint32_t prev = 0xff000000;
+    int run = 0;
+    std::vector<std::uint8_t> row(size_t(w)*4);
+    for (int y=0; y<h; y++) {
+        convert_row(image, y, 4, row.data());
+        for (int x=0; x<w; x++) {
+            const std::uint8_t* c = row.data() + x*4;
+            const std::uint32_t px = c[0] | c[1]<<8 | c[2]<<16 | std::uint32_t(c[3])<<24;
+            if (px==prev) {
+                if (++run==62) { *p++ = op_run | (run-1); run = 0; }
+                continue;
+            }
+            if (run) { *p++ = op_run | (run-1); run = 0; }
+            const int hash = (c[0]*3 + c[1]*5 + c[2]*7 + c[3]*11) % 64;
+            if (index[hash]==px) *p++ = op_index | hash;
+            else {
+                index[hash] = px;
+                if (c[3]==prev>>24) {
+                    const std::int8_t vr = c[0] - std::uint8_t(prev), vg = c[1] - std::uint8_t(prev>>8), vb = c[2] - std::uint8_t(prev>>16);
+                    const std::int8_t vg_r = vr - vg, vg_b = vb - vg;
+                    if (vr>-3 && vr<2 && vg>-3 && vg<2 && vb>-3 && vb<2)
+                        *p++ = op_diff | (vr+2)<<4 | (vg+2)<<2 | (vb+2);
+                    else if (vg_r>-9 && vg_r<8 && vg>-33 && vg<32 && vg_b>-9 && vg_b<8) {
+                        *p++ = op_luma | (vg+32);
+                        *p++ = (vg_r+8)<<4 | (vg_b+8);
+                    } else {
+                        *p++ = op_rgb;
+                        *p++ = c[0]; *p++ = c[1]; *p++ = c[2];
+                    }
+                } else {
+                    *p++ = op_rgba;
+                    *p++ = c[0]; *p++ = c[1]; *p++ = c[2]; *p++ = c[3];
+                }
+            }
+            prev = px;
+        }
+    }
+    if (run) *p++ = op_run | (run-1);
+    for (const std::uint8_t b : padding) *p++ = b;
+    out.resize(p - out.data());
+    return out;
+}
+
+bool write_image(const TGAImage& image, const std::string& filename) {
+    if (image_format(filename)==ImageFormat::QOI) return write_file(encode_qoi(image), filename);
+    return image.write_tga_file(filename);
+}
+
+std::unique_ptr<ImageWriter> make_image_writer(const ImageFormat format, const std::string& output, const bool mapped) {
+    if (format==ImageFormat::TGA || format==ImageFormat::QOI) return std::make_unique<FileWriter>(format);
+    const int channels = format==ImageFormat::RGBA ? 4 : 3;
+    if (output=="-") {
+        if (mapped) std::cerr << "stdout can't be memory-mapped, the frames are streamed\n";
+        return std::make_unique<StreamWriter>(stdout, false, channels);
+    }
+#if defined(__unix__) || defined(__APPLE__)
+    if (mapped) {
+        const int fd = ::open(output.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd<0) {
+            std::cerr << "can't open file " << output << "\n";
+            return nullptr;
+        }
+        return std::make_unique<MappedWriter>(fd, channels);
+    }
+#else
+    if (mapped) std::cerr << "no memory-mapped output on this platform, the frames are streamed\n";
+#endif
+    std::FILE* out = std::fopen(output.c_str(), "wb");
+    if (!out) {
+        std::cerr << "can't open file " << output << "\n";
+        return nullptr;
+    }
+    return std::make_unique<StreamWriter>(out, true, channels);
+}
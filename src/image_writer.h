@@ -0,0 +1,36 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "tgaimage.h"
+
+// Output formats of the frames. TGA and QOI write one file per frame. The raw formats write the pixels only, top row
+// first, and stream the frames back to back to stdout ("-"), a FIFO or a file, for an encoder to read directly:
+//   tinyrenderer -orbit 120 -format rgb -o - | ffmpeg -f rawvideo -pixel_format rgb24 -video_size 800x800 -i - out.mp4
+enum class ImageFormat { TGA, QOI, RGB, RGBA };
+
+bool parse_image_format(const char* name, ImageFormat& format); // tga, qoi, rgb or rgba
+ImageFormat image_format(const std::string& filename);         // from the extension, TGA if unknown
+const char* image_extension(const ImageFormat format);
+
+// the whole .qoi file (https://qoiformat.org) in memory, lossless, RGB or RGBA like the image
+std::vector<std::uint8_t> encode_qoi(const TGAImage& image);
+
+// writes the image to a .tga or .qoi file, depending on the extension of filename
+bool write_image(const TGAImage& image, const std::string& filename);
+
+// Destination of the frames, write() is called once per frame, in order. filename is the name of the frame; the
+// streams ignore it and append to the destination they were opened with.
+class ImageWriter {
+public:
+    virtual ~ImageWriter() = default;
+    virtual bool write(const TGAImage& image, const std::string& filename) = 0;
+};
+
+// output: the destination of a raw stream, "-" for stdout; mapped: the raw frames are converted straight into a
+// memory-mapped file instead of going through write() calls. Returns null if the destination can't be opened.
+std::unique_ptr<ImageWriter> make_image_writer(const ImageFormat format, const std::string& output="-", const bool mapped=false);
+
+#endif
@@ -1,74 +1,429 @@
 #include <vector>
 #include <cmath>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cstring>
+#include <cctype>
+#include <cstdlib>
+#include <string>
+#include <algorithm>
+#include <limits>
 
 #include "tgaimage.h"
 #include "geometry.h"
 #include "model.h"
+#include "scene.h"
 #include "our_gl.h"
+#include "shaders.h"
+#include "frame_writer.h"
+#include "image_writer.h"
+#include "profile.h"
+#include "render_server.h"
 
 constexpr int width  = 800; // output image size
 constexpr int height = 800;
 
-Model* model = nullptr;
-
 constexpr vec3 light_dir{1,1,1}; // light source
 constexpr vec3       eye{1,1,3}; // camera position
 constexpr vec3    center{0,0,0}; // camera direction
 constexpr vec3        up{0,1,0}; // camera up vector
 
+static bool fast_shading = false; // approximate specular, the models decode their normal maps once
+
+// camera and light of one frame of a batch
+struct Frame {
+    vec3 eye, center, light;
+};
 
-struct Shader : public IShader {
-    mat<2,3> varying_uv;  // same as above
-    mat<4,4> uniform_M;   //  Projection*ModelView
-    mat<4,4> uniform_MIT; // (Projection*ModelView).invert_transpose()
 
-    virtual vec4 vertex(int iface, int nthvert) {
-        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
-        vec4 gl_Vertex = embed<4>(model->vert(iface, nthvert)); // read the vertex from .obj file
-        return Projection*ModelView*gl_Vertex; // transform it to screen coordinates
+// The name of frame k: the first %d or %0Nd of the pattern is replaced by the frame number, anything else is kept as
+// is. The pattern comes from the command line, so it is never handed to printf.
+static std::string frame_filename(const std::string& pattern, const int k) {
+    std::string name;
+    bool numbered = false;
+    for (size_t i=0; i<pattern.size(); i++) {
+        if (pattern[i]!='%') { name += pattern[i]; continue; }
+        size_t j = i+1;
+        while (j<pattern.size() && j<i+4 && std::isdigit(static_cast<unsigned char>(pattern[j]))) j++;
+        const bool padded = j>i+1 && pattern[i+1]=='0';
+        if (numbered || j==pattern.size() || pattern[j]!='d' || (j>i+1 && !padded)) { name += '%'; continue; }
+        std::string number = std::to_string(k);
+        const int digits = padded ? std::atoi(pattern.substr(i+2, j-i-2).c_str()) : 0;
+        if (int(number.size())<digits) number.insert(0, digits-number.size(), '0');
+        name += number;
+        numbered = true;
+        i = j;
     }
+    return name;
+}
 
-    virtual bool fragment(vec3 bar, TGAColor &color) {
-        vec2 uv = varying_uv*bar;
-        vec3 n = proj<3>(uniform_MIT*embed<4>(model->normal(uv))).normalize();
-        vec3 l = proj<3>(uniform_M  *embed<4>(light_dir        )).normalize();
-        vec3 r = (n*(n*l*2.f) - l).normalize();   // reflected light
-        double spec = pow(std::max(r[2], 0.), model->specular(uv));
-        double diff = std::max(0., n*l);
-        TGAColor c = model->diffuse(uv);
-        color = c;
-        for (int i=0; i<3; i++) color[i] = std::min<double>(5 + c[i]*(diff + .6*spec), 255);
+// Reads a camera path, one frame per line: eye, center and light direction, 9 numbers. Empty lines and # comments
+// are skipped.
+static bool read_path(const char* filename, std::vector<Frame>& frames) {
+    std::ifstream in(filename);
+    if (!in.is_open()) {
+        std::cerr << "can't open file " << filename << std::endl;
         return false;
     }
+    std::string line;
+    for (int nline=1; std::getline(in, line); nline++) {
+        line = line.substr(0, line.find('#'));
+        if (line.find_first_not_of(" \t\r")==std::string::npos) continue;
+        std::istringstream iss(line);
+        Frame f;
+        for (vec3* v : {&f.eye, &f.center, &f.light})
+            for (int i=0; i<3; i++) iss >> (*v)[i];
+        if (iss.fail()) {
+            std::cerr << filename << ":" << nline << ": expected eye, center and light direction" << std::endl;
+            return false;
+        }
+        frames.push_back(f);
+    }
+    return true;
+}
+
+// Turntable: the camera and the light turn together around the vertical axis through the center.
+static std::vector<Frame> orbit(const int nframes) {
+    constexpr double pi = 3.14159265358979323846;
+    std::vector<Frame> frames;
+    for (int k=0; k<nframes; k++) {
+        const real a = 2*pi*k/nframes, c = std::cos(a), s = std::sin(a);
+        auto rotate = [c, s](const vec3 v) { return vec3{c*v.x + s*v.z, v.y, -s*v.x + c*v.z}; };
+        frames.push_back({center + rotate(eye-center), center, rotate(light_dir)});
+    }
+    return frames;
+}
+
+// the image is framed in the middle three quarters of the target, and so is the scene in the shadow map
+static mat<4,4> framed(const int width, const int height) {
+    return viewport(width/8, height/8, width*3/4, height*3/4);
+}
+
+// Depth of the scene seen from the light, an orthographic projection along the light direction that is scaled for the
+// scene to fit in the viewport. Returns the transform from world to light space.
+static mat<4,4> render_shadowmap(const Frame& frame, const Scene& scene, const DrawOptions& options, DepthBuffer& shadowmap) {
+    const vec3 l = frame.light.normalized();
+    const mat<4,4> ModelView = lookat(frame.center + l, frame.center, std::abs(l.y)>.99 ? vec3{1, 0, 0} : up);
+    DrawOptions opt = options;
+    opt.viewport = framed(shadowmap.width(), shadowmap.height());
+    Box box = Box::empty();
+    for (int i=0; i<8; i++) box.extend(proj<3>(ModelView*embed<4>(scene.bounds().corner(i))));
+    const real scale = 2/std::max({box.max.x-box.min.x, box.max.y-box.min.y, real(1e-6)});
+    mat<4,4> fit = mat<4,4>::identity(); // the depth is not scaled, the bias stays in world units
+    fit[0][0] = fit[1][1] = scale;
+    fit[0][3] = -scale*(box.min.x+box.max.x)/2;
+    fit[1][3] = -scale*(box.min.y+box.max.y)/2;
+    const mat<4,4> M = fit*ModelView;
+    shadowmap.clear(std::numeric_limits<float>::lowest()); // the light space depth is negative behind the center
+    std::vector<int> casters;
+    scene.cull(M, opt.viewport, shadowmap.width(), shadowmap.height(), casters);
+    for (int i : casters) {
+        const Model& model = scene.model(scene.instance(i).model);
+        const mat<4,4> MT = M*scene.instance(i).transform;
+        draw_depth(model.vert_indices(), model.nfaces(), model.nverts(), [&](int v) { return MT*embed<4>(model.vert(v)); }, shadowmap, opt);
+    }
+    return M;
+}
+
+// world to clip transform of the camera of the frame
+static mat<4,4> camera(const Frame& frame) {
+    return projection(-1./(frame.eye-frame.center).norm())*lookat(frame.eye, frame.center, up);
+}
+
+// phong shader of instance i, Mlight is the world to light space transform of the shadow map
+static PhongShader phong_shader(const Scene& scene, const int i, const mat<4,4>& viewport, const mat<4,4>& view_proj, const vec3 light,
+                                const Sampler::Filter filter, const mat<4,4>& Mlight, const DepthBuffer* shadowmap) {
+    PhongShader shader(&scene.model(scene.instance(i).model), viewport, view_proj, scene.instance(i).transform, light);
+    shader.varyings.sampler.filter = filter;
+    shader.uniform_Mshadow = Mlight*view_proj.inverse();
+    if (shadowmap) shader.uniform_Vshadow = framed(shadowmap->width(), shadowmap->height());
+    shader.shadowmap = shadowmap;
+    shader.fast_specular = fast_shading;
+    return shader;
+}
+
+// draws the instances of the scene that are in view, visible receives their indices
+static DrawStats render(const Frame& frame, const Scene& scene, const char* shader_name, const Sampler::Filter filter, const DrawOptions& options,
+                        RenderTarget& target, DepthBuffer& zbuffer, DepthBuffer* shadowmap, std::vector<int>& visible) {
+    const mat<4,4> Mlight = shadowmap ? render_shadowmap(frame, scene, options, *shadowmap) : mat<4,4>::identity();
+    const int width = target.width(), height = target.height();
+    const mat<4,4> view_proj = camera(frame);
+    DrawOptions opt = options;
+    opt.viewport = framed(width, height);
+    scene.cull(view_proj, opt.viewport, width, height, visible);
+
+    DrawStats stats;
+    for (int i : visible) {
+        const Model* model = &scene.model(scene.instance(i).model);
+        const Uniforms uniforms(view_proj, scene.instance(i).transform, frame.light);
+        if (!strcmp(shader_name, "gouraud")) stats += draw(model->nfaces(), GouraudShader(model, uniforms), target, zbuffer, opt);
+        else if (!strcmp(shader_name, "tex")) stats += draw(model->nfaces(), TexShader(model, uniforms), target, zbuffer, opt);
+        else if (!strcmp(shader_name, "warhol")) stats += draw(model->nfaces(), WarholShader(model, uniforms), target, zbuffer, opt);
+        else {
+            const PhongShader shader = phong_shader(scene, i, opt.viewport, view_proj, frame.light, filter, Mlight, shadowmap);
+            stats += draw_indexed(model->vert_indices(), model->nfaces(), model->nverts(), shader, target, zbuffer, opt);
+        }
+    }
+    return stats;
+}
+
+// Relighting: as long as the camera stays put, the visible surface and everything the phong shader reads from the
+// textures are the same whatever the light. The G-buffer keeps them for every covered pixel, one after the other,
+// so that a new light direction is a flat pass over these arrays.
+struct GBuffer {
+    int width, height;
+    Frame frame = {};              // whose camera the buffer was built for
+    bool built = false;
+    std::vector<int> pixels;       // x+y*width of the covered pixels
+    std::vector<vec4> clip;        // clip coordinates of the visible point, for the shadow map
+    std::vector<vec3> normal;      // as given by PhongShader::normal()
+    std::vector<TGAColor> diffuse;
+    std::vector<real> specular;    // exponent
+    GBuffer(const int w, const int h) : width(w), height(h) {}
+    bool has_camera(const Frame& f) const {
+        return built && (f.eye-frame.eye).norm2()==0 && (f.center-frame.center).norm2()==0;
+    }
 };
 
+// rasterizes the visible instances into a visibility buffer, then reads the attributes of the visible points
+static DrawStats build_gbuffer(const Frame& frame, const Scene& scene, const Sampler::Filter filter, const DrawOptions& options,
+                               DepthBuffer& zbuffer, std::vector<int>& visible, GBuffer& g) {
+    const mat<4,4> view_proj = camera(frame);
+    DrawOptions opt = options;
+    opt.viewport = framed(g.width, g.height);
+    scene.cull(view_proj, opt.viewport, g.width, g.height, visible);
+    VisibilityBuffer local;
+    VisibilityBuffer& vbuffer = options.vbuffer ? *options.vbuffer : local; // left empty like the deferred draws leave it
+    if (vbuffer.width!=g.width || vbuffer.height!=g.height) vbuffer = VisibilityBuffer(g.width, g.height);
+    std::vector<PhongShader> shaders; // of the visible instances
+    std::vector<std::uint32_t> first; // the face ids of an instance start after first+1
+    DrawStats stats;
+    for (int i : visible) {
+        const PhongShader shader = phong_shader(scene, i, opt.viewport, view_proj, frame.light, filter, mat<4,4>::identity(), nullptr);
+        const Model& model = *shader.model;
+        first.push_back(first.empty() ? 0 : first.back() + shaders.back().model->nfaces());
+        shaders.push_back(shader);
+        stats += draw_visibility(model.vert_indices(), model.nfaces(), model.nverts(), [&](int v) { return shader.vertex(v); },
+                                 first.back(), vbuffer, zbuffer, opt);
+    }
+
+    g.pixels.clear();
+    for (int p=0; p<g.width*g.height; p++)
+        if (vbuffer.id[p]) g.pixels.push_back(p);
+    const int n = g.pixels.size();
+    g.clip.resize(n);
+    g.normal.resize(n);
+    g.diffuse.resize(n);
+    g.specular.resize(n);
+    parallel_chunks(n, options.nthreads, [&](int begin, int end, int chunk) {
+        PROFILE_SCOPE(Fragment, chunk);
+        PhongShader s;
+        std::uint32_t face = 0; // the id of the face s is set up for, neighbouring pixels mostly share it
+        for (int k=begin; k<end; k++) {
+            const std::uint32_t id = vbuffer.id[g.pixels[k]];
+            if (id!=face) {
+                const int m = std::upper_bound(first.begin(), first.end(), id-1) - first.begin() - 1;
+                s = shaders[m];
+                for (int j=0; j<3; j++) s.vertex(id-1-first[m], j);
+                face = id;
+            }
+            const vec3 bar = vbuffer.bar[g.pixels[k]];
+            vbuffer.id[g.pixels[k]] = 0;
+            const vec2 uv = s.varyings.uv*bar;
+            g.clip[k] = s.clip(bar);
+            g.normal[k] = s.normal(uv);
+            g.diffuse[k] = s.model->diffuse(uv, s.varyings.sampler);
+            g.specular[k] = s.model->specular(uv, s.varyings.sampler);
+        }
+    });
+    stats.shaded += n;
+    g.frame = frame;
+    g.built = true;
+    return stats;
+}
+
+// shades the G-buffer for the light of the frame, the image is the one render() gives with the phong shader
+static void relight(const Frame& frame, const Scene& scene, const DrawOptions& options, const GBuffer& g, RenderTarget& target, DepthBuffer* shadowmap) {
+    PhongShader s; // for its lighting, without a model
+    const mat<4,4> Mlight = shadowmap ? render_shadowmap(frame, scene, options, *shadowmap) : mat<4,4>::identity();
+    const mat<4,4> view_proj = camera(frame);
+    s.uniform_l = proj<3>(view_proj*embed<4>(frame.light)).normalized();
+    s.uniform_Mshadow = Mlight*view_proj.inverse();
+    if (shadowmap) s.uniform_Vshadow = framed(shadowmap->width(), shadowmap->height());
+    s.shadowmap = shadowmap;
+    s.fast_specular = fast_shading;
+    parallel_chunks(g.pixels.size(), options.nthreads, [&](int begin, int end, int chunk) {
+        PROFILE_SCOPE(Fragment, chunk);
+        for (int k=begin; k<end; k++) {
+            TGAColor color;
+            s.light(g.normal[k], g.diffuse[k], g.specular[k], s.shadow(g.clip[k]), color);
+            target.set(g.pixels[k]%g.width, g.pixels[k]/g.width, color);
+        }
+    });
+}
+
 int main(int argc, char** argv) {
-    if(argc==2) { model = new Model(argv[1]); }
-    else { model = new Model("obj/african_head.obj"); }
+    const char* filename = "obj/african_head.obj";
+    const char* scene_file = nullptr;
+    const char* shader_name = "phong";
+    const char* output = nullptr;
+    DrawOptions options;
+    bool use_cache = true;
+    Sampler::Filter filter = Sampler::Bilinear;
+    std::vector<Frame> frames;
+    const char* trace = nullptr;   // Chrome trace of the pipeline stages
+    const char* heatmap = nullptr; // overdraw image
+    bool shadows = true;
+    bool relit = false; // frames that only move the light reuse a G-buffer
+    ImageFormat format = ImageFormat::TGA;
+    bool format_given = false;
+    bool mapped = false; // raw frames go to a memory-mapped file
+    const char* serve_path = nullptr; // socket of the render server
+    ServerOptions server;
+    for (int i=1; i<argc; i++) {
+        if (!strcmp(argv[i], "-t") && i+1<argc) options.nthreads = render_threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-nocache")) use_cache = false;
+        else if (!strcmp(argv[i], "-deferred")) options.shading = ShadingMode::Deferred;
+        else if (!strcmp(argv[i], "-zprepass")) options.zprepass = true;
+        else if (!strcmp(argv[i], "-noshadows")) shadows = false;
+        else if (!strcmp(argv[i], "-relight")) relit = true;
+        else if (!strcmp(argv[i], "-fastshading")) fast_shading = decode_normal_maps = true;
+        else if (!strcmp(argv[i], "-cull") && i+1<argc) {
+            const char* cull = argv[++i];
+            options.cull = !strcmp(cull, "none") ? CullMode::None : !strcmp(cull, "front") ? CullMode::Front : CullMode::Back;
+        }
+        else if (!strcmp(argv[i], "-shader") && i+1<argc) shader_name = argv[++i];
+        else if (!strcmp(argv[i], "-filter") && i+1<argc) filter = !strcmp(argv[++i], "nearest") ? Sampler::Nearest : Sampler::Bilinear;
+        else if (!strcmp(argv[i], "-simd") && i+1<argc) {
+            const char* isa = argv[++i];
+            SimdLevel level = !strcmp(isa, "avx2") ? SimdLevel::AVX2 : !strcmp(isa, "sse4.1") ? SimdLevel::SSE41 : SimdLevel::Scalar;
+            if (!set_simd_level(level)) std::cerr << "this CPU does not support " << isa << std::endl;
+        }
+        else if (!strcmp(argv[i], "-orbit") && i+1<argc) {
+            std::vector<Frame> path = orbit(std::max(1, atoi(argv[++i])));
+            frames.insert(frames.end(), path.begin(), path.end());
+        }
+        else if (!strcmp(argv[i], "-path") && i+1<argc) {
+            if (!read_path(argv[++i], frames)) return 1;
+        }
+        else if (!strcmp(argv[i], "-o") && i+1<argc) output = argv[++i];
+        else if (!strcmp(argv[i], "-format") && i+1<argc) {
+            if (!parse_image_format(argv[++i], format)) {
+                std::cerr << "unknown image format " << argv[i] << ", the formats are tga, qoi, rgb and rgba" << std::endl;
+                return 1;
+            }
+            format_given = true;
+        }
+        else if (!strcmp(argv[i], "-mmap")) mapped = true;
+        else if (!strcmp(argv[i], "-scene") && i+1<argc) scene_file = argv[++i];
+        else if (!strcmp(argv[i], "-trace") && i+1<argc) trace = argv[++i];
+        else if (!strcmp(argv[i], "-heatmap") && i+1<argc) heatmap = argv[++i];
+        else if (!strcmp(argv[i], "-serve") && i+1<argc) serve_path = argv[++i];
+        else if (!strcmp(argv[i], "-workers") && i+1<argc) server.workers = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-budget") && i+1<argc) server.budget = std::size_t(std::max(0, atoi(argv[++i])))<<20; // MB
+        else filename = argv[i];
+    }
+    const bool cast_shadows = shadows && !strcmp(shader_name, "phong"); // only the phong shader casts shadows
+    if (relit && strcmp(shader_name, "phong")) {
+        std::cerr << "-relight needs the phong shader, ignored" << std::endl;
+        relit = false;
+    }
 
-    // build transformation matrices
-    lookat(eye, center, up); // ModelView
-    viewport(width/8, height/8, width*3/4, height*3/4);
-    projection(-1./(eye-center).norm());
+    if (serve_path) {
+        // the requests render concurrently, every draw takes its camera and viewport from its own arguments
+        server.use_cache = use_cache;
+        return serve(serve_path, server, [&](const RenderRequest& req, const std::shared_ptr<const Model>& model) {
+            Scene scene;
+            scene.add_instance(scene.add_model(model), mat<4,4>::identity());
+            scene.build();
+            RenderTarget target(req.width, req.height);
+            DepthBuffer zbuffer(req.width, req.height);
+            DepthBuffer shadowmap(cast_shadows ? req.width : 0, cast_shadows ? req.height : 0);
+            VisibilityBuffer vbuffer;
+            DrawOptions opt = options;
+            opt.vbuffer = &vbuffer;
+            std::vector<int> visible;
+            render({req.eye, req.center, req.light}, scene, shader_name, filter, opt, target, zbuffer, cast_shadows ? &shadowmap : nullptr, visible);
+            TGAImage image(req.width, req.height, TGAImage::RGB);
+            target.resolve(image);
+            return write_image(image, req.output) ? std::string() : "can't write " + req.output;
+        }) ? 0 : 1;
+    }
 
+    const bool batch = !frames.empty();
+    if (!batch) frames.push_back({eye, center, light_dir});
+    if (!format_given && output) format = !strcmp(output, "-") ? ImageFormat::RGB : image_format(output);
+    const bool stream = format==ImageFormat::RGB || format==ImageFormat::RGBA; // all the frames go to output
+    // pattern of the frame names (see frame_filename()), or the destination of the stream
+    const std::string pattern = output ? output : stream ? "-" : std::string(batch ? "frame%04d." : "output.") + image_extension(format);
+    std::unique_ptr<ImageWriter> image_writer = make_image_writer(format, pattern, mapped);
+    if (!image_writer) return 1;
+    if (trace) profile::start();
+    if (heatmap) profile::start_heatmap(width, height);
+    Scene scene; // a scene file, or a single instance of the model
+    {
+        PROFILE_SCOPE(Load, 0);
+        if (!scene_file) scene.add_instance(scene.add_model(filename, use_cache), mat<4,4>::identity());
+        else if (!scene.load(scene_file, use_cache)) return 1;
+        scene.build();
+    }
+
+    // the models are loaded once and the buffers are reused, a frame is rendered while the previous one is written;
+    // the pipeline draws into a tiled target that is converted to a linear image only to be saved
+    RenderTarget target(width, height);
     TGAImage image(width, height, TGAImage::RGB);
-    std::vector<double> zbuffer(width*height, std::numeric_limits<double>::min());
-
-    Shader shader;
-    shader.uniform_M = Projection * ModelView;
-    shader.uniform_MIT = (Projection * ModelView).inverse_transpose();
-    int n = model->nfaces();
-    for(int i=0; i<n; i++) {
-        vec4 screen_coords[3];
-        for(int j=0; j<3; j++) {
-            screen_coords[j] = shader.vertex(i, j);
+    DepthBuffer zbuffer(width, height);
+    DepthBuffer shadowmap(width, height);
+    VisibilityBuffer vbuffer; // sized by the first deferred draw
+    options.vbuffer = &vbuffer;
+    FrameWriter writer(std::move(image_writer));
+    DrawStats stats;
+    std::vector<int> visible;
+    long long ninstances = 0;
+    GBuffer gbuffer(width, height);
+    int nbuilt = 0; // G-buffers
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t k=0; k<frames.size(); k++) {
+        target.clear();
+        if (!relit || !gbuffer.has_camera(frames[k])) {
+            zbuffer.clear();
+            if (!relit) stats += render(frames[k], scene, shader_name, filter, options, target, zbuffer, cast_shadows ? &shadowmap : nullptr, visible);
+            else stats += build_gbuffer(frames[k], scene, filter, options, zbuffer, visible, gbuffer), nbuilt++;
+            ninstances += visible.size();
         }
-        triangle(screen_coords, shader, image, zbuffer);
-        //std::cout << "\rtriangles: " << i+1 << " / " << n << std::flush;
+        if (relit) relight(frames[k], scene, options, gbuffer, target, cast_shadows ? &shadowmap : nullptr);
+        const std::string name = stream ? "" : frame_filename(pattern, k);
+        {
+            PROFILE_SCOPE(Output, 0);
+            target.resolve(image);
+        }
+        writer.submit(image, name);
     }
+    bool written = writer.wait();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (batch) std::cerr << frames.size() << " frames in " << seconds << "s (" << frames.size()/seconds << " fps), totals:" << std::endl;
+    if (scene.ninstances()>1)
+        std::cerr << "instances: " << ninstances << " drawn, " << scene.ninstances()*frames.size()-ninstances << " culled, "
+                  << scene.nmodels() << " models" << std::endl;
+    std::cerr << "triangles: " << stats.triangles << " submitted, " << stats.rejected << " outside, " << stats.culled << " culled, "
+              << stats.clipped << " clipped, " << stats.drawn << " rasterized" << std::endl;
+    std::cerr << "vertex shader invocations: " << stats.vertices << " for " << stats.corners << " corners (" << stats.corners-stats.vertices << " saved)" << std::endl;
+    std::cerr << "pixels: " << stats.tested << " tested, " << stats.tested-stats.depth_passed << " depth-rejected, "
+              << stats.depth_passed << " passed" << std::endl;
+    std::cerr << "fragments shaded: " << stats.shaded;
+    if (options.shading==ShadingMode::Deferred)
+        std::cerr << " (forward: " << stats.depth_passed << ", " << 100.*(stats.depth_passed-stats.shaded)/std::max(1ll, stats.depth_passed) << "% saved)";
+    std::cerr << ", " << stats.discarded << " discarded" << std::endl;
+    if (tga_read_stats.files)
+        std::cerr << "textures: " << tga_read_stats.files << " decoded, " << tga_read_stats.bytes/1e6 << " MB at "
+                  << tga_read_stats.bytes*1e3/std::max(1ll, tga_read_stats.nanoseconds.load()) << " MB/s" << std::endl;
+    if (relit) std::cerr << "relighting: " << frames.size() << " frames shaded from " << nbuilt << " G-buffers" << std::endl;
+    profile::summary(std::cerr);
+    if (trace && !profile::write_trace(trace)) written = false;
+    if (heatmap && !profile::write_heatmap(heatmap)) written = false;
 
-    image.write_tga_file("output.tga");
-    delete model;
-    return 0;
-}
\ No newline at end of file
+    return written ? 0 : 1;
+}
@@ -0,0 +1,45 @@
+#include <fstream>
+#include "mapped_file.h"
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::string& filename) {
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd<0) return;
+    struct stat st;
+    if (fstat(fd, &st)==0) {
+        len = st.st_size;
+        open = true;
+        if (len) {
+            void* p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p!=MAP_FAILED) {
+                madvise(p, len, MADV_SEQUENTIAL);
+                ptr = static_cast<const char*>(p);
+                mapped = true;
+            }
+        }
+    }
+    ::close(fd);
+    if (!open || mapped || !len) return;
+    open = false; // the mapping failed, read the file instead
+#endif
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
+    if (!in.is_open()) return;
+    buffer.resize(static_cast<std::size_t>(in.tellg()));
+    in.seekg(0);
+    if (!in.read(buffer.data(), buffer.size())) return;
+    ptr = buffer.data();
+    len = buffer.size();
+    open = true;
+}
+
+MappedFile::~MappedFile() {
+#if defined(__unix__) || defined(__APPLE__)
+    if (mapped) munmap(const_cast<char*>(ptr), len);
+#endif
+}
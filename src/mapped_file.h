@@ -0,0 +1,26 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// read-only view of a whole file, memory-mapped where the platform allows it and read into memory otherwise
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filename);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool is_open() const { return open; }
+    const char* data() const { return ptr; }
+    std::size_t size() const { return len; }
+private:
+    bool open = false;
+    const char* ptr = nullptr;
+    std::size_t len = 0;
+    bool mapped = false;
+    std::vector<char> buffer; // fallback storage when the file could not be mapped
+};
+
+#endif
@@ -0,0 +1,258 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <queue>
+#include "meshopt.h"
+#include "model.h"
+#include "our_gl.h"
+
+namespace {
+    // Forsyth's scoring: the vertices that are in the cache and the ones with few remaining faces score high
+    constexpr real cache_decay_power = 1.5, last_face_score = .75, valence_boost_scale = 2, valence_boost_power = .5;
+
+    real vertex_score(const int cache_pos, const int remaining, const int cache_size) {
+        if (!remaining) return -1; // no face left to draw
+        real score = 0;
+        if (cache_pos>=0) {
+            if (cache_pos<3) score = last_face_score; // used by the last face, whatever the order of its corners
+            else score = std::pow(1 - real(cache_pos-3)/(cache_size-3), cache_decay_power);
+        }
+        return score + valence_boost_scale*std::pow(real(remaining), -valence_boost_power);
+    }
+
+    // faces of every vertex, in CSR form
+    void vertex_faces(const int* indices, const int nfaces, const int nverts, std::vector<int>& offset, std::vector<int>& faces) {
+        offset.assign(nverts+1, 0);
+        for (int i=0; i<nfaces*3; i++) offset[indices[i]+1]++;
+        for (int v=0; v<nverts; v++) offset[v+1] += offset[v];
+        faces.resize(nfaces*3);
+        std::vector<int> fill(offset.begin(), offset.end()-1);
+        for (int i=0; i<nfaces*3; i++) faces[fill[indices[i]]++] = i/3;
+    }
+}
+
+std::vector<int> optimize_vertex_cache(const int* indices, const int nfaces, const int nverts, const int cache_size) {
+    std::vector<int> offset, adjacency;
+    vertex_faces(indices, nfaces, nverts, offset, adjacency);
+    std::vector<int> remaining(nverts), cache_pos(nverts, -1);
+    std::vector<real> vscore(nverts);
+    for (int v=0; v<nverts; v++) {
+        remaining[v] = offset[v+1]-offset[v];
+        vscore[v] = vertex_score(-1, remaining[v], cache_size);
+    }
+    std::vector<real> fscore(nfaces);
+    for (int f=0; f<nfaces; f++) fscore[f] = vscore[indices[f*3]] + vscore[indices[f*3+1]] + vscore[indices[f*3+2]];
+
+    // Restarts, when no cached vertex has a face left: the best face of the whole mesh, all its vertices out of the
+    // cache then. Its score changes only when one of its vertices gets a face drawn, and the vertex leaves the cache
+    // before the next restart, so at a restart the faces of the vertices evicted since the previous one are queued
+    // again with their new score; the outdated entries are skipped. Ties go to the lowest face index.
+    auto restart_score = [&](const int f) {
+        return vertex_score(-1, remaining[indices[f*3]], cache_size) + vertex_score(-1, remaining[indices[f*3+1]], cache_size)
+             + vertex_score(-1, remaining[indices[f*3+2]], cache_size);
+    };
+    std::priority_queue<std::pair<real, int>> restarts; // score, -face
+    for (int f=0; f<nfaces; f++) restarts.emplace(fscore[f], -f);
+    std::vector<int> evicted;
+    std::vector<bool> is_evicted(nverts, false);
+
+    std::vector<bool> added(nfaces, false);
+    std::vector<int> order, cache, next_cache;
+    order.reserve(nfaces);
+    auto restart = [&]() {
+        while (!restarts.empty()) {
+            const auto [score, f] = restarts.top();
+            restarts.pop();
+            if (!added[-f] && score==restart_score(-f)) return -f;
+        }
+        return -1;
+    };
+    int best = restart(); // the first face is a restart too
+    while (best>=0) {
+        order.push_back(best);
+        added[best] = true;
+        // the vertices of the face move to the front of the LRU cache
+        next_cache.clear();
+        for (int j=0; j<3; j++)
+            if (std::find(next_cache.begin(), next_cache.end(), indices[best*3+j])==next_cache.end()) next_cache.push_back(indices[best*3+j]);
+        const size_t nfront = next_cache.size();
+        for (int v : cache)
+            if (std::find(next_cache.begin(), next_cache.begin()+nfront, v)==next_cache.begin()+nfront) next_cache.push_back(v);
+        for (int j=0; j<3; j++) {
+            const int v = indices[best*3+j];
+            int* begin = &adjacency[offset[v]], *end = begin + remaining[v];
+            std::remove(begin, end, best); // the live faces of a vertex are kept at the front of its list
+            remaining[v]--;
+        }
+        // scores of the vertices whose cache position changed, including the evicted ones
+        for (size_t k=0; k<next_cache.size(); k++) {
+            const int v = next_cache[k];
+            cache_pos[v] = int(k)<cache_size ? int(k) : -1;
+            vscore[v] = vertex_score(cache_pos[v], remaining[v], cache_size);
+            if (cache_pos[v]<0 && !is_evicted[v]) {
+                is_evicted[v] = true;
+                evicted.push_back(v);
+            }
+        }
+        if ((int)next_cache.size()>cache_size) next_cache.resize(cache_size);
+        std::swap(cache, next_cache);
+
+        // the next face is the best one using a cached vertex, or the best one left if there is none
+        best = -1;
+        real best_score = -1;
+        for (int v : cache)
+            for (int k=offset[v]; k<offset[v]+remaining[v]; k++) {
+                const int f = adjacency[k];
+                fscore[f] = vscore[indices[f*3]] + vscore[indices[f*3+1]] + vscore[indices[f*3+2]];
+                if (fscore[f]>best_score) best_score = fscore[f], best = f;
+            }
+        if (best<0) {
+            for (int v : evicted) {
+                is_evicted[v] = false;
+                for (int i=offset[v]; i<offset[v]+remaining[v]; i++) restarts.emplace(restart_score(adjacency[i]), -adjacency[i]);
+            }
+            evicted.clear();
+            best = restart();
+        }
+    }
+    return order;
+}
+
+std::vector<int> optimize_overdraw(const int* indices, const vec3* positions, const int nfaces, const int nverts,
+                                   const std::vector<int>& order, const double threshold, const int cache_size) {
+    // misses of every face in a FIFO cache; a face missing its three vertices starts a new run
+    std::vector<int> misses(nfaces), timestamp(nverts, -cache_size-1);
+    int time = 0;
+    for (int k=0; k<nfaces; k++) {
+        misses[k] = 0;
+        for (int j=0; j<3; j++) {
+            const int v = indices[order[k]*3+j];
+            if (time-timestamp[v]<=cache_size) continue;
+            timestamp[v] = ++time;
+            misses[k]++;
+        }
+    }
+    std::vector<int> hard;
+    for (int k=0; k<nfaces; k++)
+        if (!k || misses[k]==3) hard.push_back(k);
+    hard.push_back(nfaces);
+
+    // soft boundaries: a cluster ends as soon as its ACMR, starting from an empty cache since the clusters get moved
+    // around, is close enough to the one of its run
+    std::vector<int> clusters;
+    auto face_misses = [&](const int k) {
+        int m = 0;
+        for (int j=0; j<3; j++) {
+            const int v = indices[order[k]*3+j];
+            if (time-timestamp[v]<=cache_size) continue;
+            timestamp[v] = ++time;
+            m++;
+        }
+        return m;
+    };
+    for (size_t h=0; h+1<hard.size(); h++) {
+        int run_misses = 0;
+        for (int k=hard[h]; k<hard[h+1]; k++) run_misses += misses[k];
+        const double target = threshold*run_misses/(hard[h+1]-hard[h]);
+        int start = hard[h], cluster_misses = 0;
+        clusters.push_back(start);
+        time += cache_size+1; // flush
+        for (int k=hard[h]; k+1<hard[h+1]; k++) {
+            cluster_misses += face_misses(k);
+            if (cluster_misses<=target*(k-start+1)) {
+                start = k+1, cluster_misses = 0;
+                clusters.push_back(start);
+                time += cache_size+1;
+            }
+        }
+    }
+    clusters.push_back(nfaces);
+
+    // occlusion potential: area-weighted centroid of the cluster relative to the mesh one, along its average normal
+    const int nclusters = clusters.size()-1;
+    std::vector<vec3> centroid(nclusters, vec3{0, 0, 0}), normal(nclusters, vec3{0, 0, 0});
+    std::vector<real> area(nclusters, 0);
+    vec3 mesh_centroid = {0, 0, 0};
+    real mesh_area = 0;
+    for (int c=0; c<nclusters; c++) {
+        for (int k=clusters[c]; k<clusters[c+1]; k++) {
+            const vec3 a = positions[indices[order[k]*3]], b = positions[indices[order[k]*3+1]], d = positions[indices[order[k]*3+2]];
+            const vec3 n = cross(b-a, d-a); // twice the area
+            const real s = n.norm();
+            centroid[c] = centroid[c] + (a+b+d)*(s/3);
+            normal[c] = normal[c] + n;
+            area[c] += s;
+        }
+        mesh_centroid = mesh_centroid + centroid[c];
+        mesh_area += area[c];
+        if (area[c]>0) centroid[c] = centroid[c]/area[c];
+    }
+    if (mesh_area>0) mesh_centroid = mesh_centroid/mesh_area;
+    std::vector<real> key(nclusters);
+    std::vector<int> sorted(nclusters);
+    for (int c=0; c<nclusters; c++) {
+        const real len = normal[c].norm();
+        key[c] = len>0 ? (centroid[c]-mesh_centroid)*normal[c]/len : 0;
+        sorted[c] = c;
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [&](int a, int b) { return key[a]>key[b]; });
+
+    std::vector<int> result;
+    result.reserve(nfaces);
+    for (int c : sorted)
+        result.insert(result.end(), order.begin()+clusters[c], order.begin()+clusters[c+1]);
+    return result;
+}
+
+std::vector<int> reorder_faces(const int* corners, const std::vector<int>& order) {
+    std::vector<int> result(order.size()*3);
+    for (size_t k=0; k<order.size(); k++)
+        for (int j=0; j<3; j++) result[k*3+j] = corners[order[k]*3+j];
+    return result;
+}
+
+VertexCacheStats simulate_vertex_cache(const int* indices, const std::vector<int>& order, const int nverts, const int cache_size) {
+    std::vector<int> timestamp(nverts, -cache_size-1), used(nverts, 0);
+    int time = 0, nused = 0;
+    for (int f : order)
+        for (int j=0; j<3; j++) {
+            const int v = indices[f*3+j];
+            if (!used[v]++) nused++;
+            if (time-timestamp[v]<=cache_size) continue;
+            timestamp[v] = ++time; // FIFO: a hit does not refresh the entry
+        }
+    const int ncorners = order.size()*3;
+    return {ncorners ? 1 - double(time)/ncorners : 0, order.empty() ? 0 : double(time)/order.size(), nused ? double(time)/nused : 0};
+}
+
+double measure_overdraw(const int* indices, const vec3* positions, const int nfaces, const int nverts, const std::vector<int>& order, const int nviews) {
+    constexpr int size = 256;
+    constexpr double pi = 3.14159265358979323846;
+    // the mesh is centered and scaled into the unit sphere
+    Box box = Box::empty();
+    for (int v=0; v<nverts; v++) box.extend(positions[v]);
+    const vec3 center = (box.min+box.max)/2;
+    real radius = 0;
+    for (int v=0; v<nverts; v++) radius = std::max(radius, (positions[v]-center).norm());
+    std::vector<vec3> unit(nverts);
+    for (int v=0; v<nverts; v++) unit[v] = (positions[v]-center)/std::max(radius, real(1e-12));
+    const std::vector<int> sorted = reorder_faces(indices, order);
+
+    DepthBuffer zbuffer(size, size);
+    DrawOptions options;
+    options.viewport = viewport(size/8, size/8, size*3/4, size*3/4);
+    double total = 0;
+    for (int i=0; i<nviews; i++) {
+        // Fibonacci sphere
+        const real h = 1 - (2*i+1.)/nviews, r = std::sqrt(1-h*h), phi = i*pi*(3-std::sqrt(5.));
+        const vec3 dir{r*std::cos(phi), h, r*std::sin(phi)};
+        const mat<4,4> M = projection(0)*lookat(dir, {0, 0, 0}, std::abs(h)>.99 ? vec3{1, 0, 0} : vec3{0, 1, 0});
+        zbuffer.clear(std::numeric_limits<float>::lowest()); // half of the mesh has a negative depth
+        const DrawStats stats = draw_depth(sorted.data(), nfaces, nverts, [&](int v) { return M*embed<4>(unit[v]); }, zbuffer, options);
+        long long covered = 0;
+        for (int y=0; y<size; y++)
+            for (int x=0; x<size; x++) covered += zbuffer.get(x, y)!=std::numeric_limits<float>::lowest();
+        total += covered ? double(stats.depth_passed)/covered : 1;
+    }
+    return total/nviews;
+}
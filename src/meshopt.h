@@ -0,0 +1,35 @@
+#ifndef MESHOPT_H
+#define MESHOPT_H
+#include <vector>
+#include "geometry.h"
+
+// Offline face reordering of indexed triangle meshes, indices[i*3+j] is the vertex of corner j of face i.
+// The functions return the new order of the faces: order[k] is the face to draw in k-th position.
+
+// Forsyth's linear-speed vertex cache optimization, with a LRU cache model of cache_size vertices
+std::vector<int> optimize_vertex_cache(const int* indices, const int nfaces, const int nverts, const int cache_size=32);
+
+// Tipsify-style overdraw reduction of an order given by optimize_vertex_cache(): the order is cut into clusters of
+// faces, at the cache flushes and wherever the ACMR of a cluster is within threshold of the one of the flush-to-flush
+// run, and the clusters are sorted by occlusion potential, i.e. the ones on the outside of the mesh that face outwards
+// first. This is front-to-back from most viewpoints.
+std::vector<int> optimize_overdraw(const int* indices, const vec3* positions, const int nfaces, const int nverts,
+                                   const std::vector<int>& order, const double threshold=1.05, const int cache_size=16);
+
+// applies a face order to a per-corner array like indices
+std::vector<int> reorder_faces(const int* corners, const std::vector<int>& order);
+
+struct VertexCacheStats {
+    double hit_rate; // of the face corners
+    double acmr;     // average cache miss ratio: vertices transformed per face, 0.5 is about the best for grids
+    double atvr;     // average transformed to vertex ratio, 1 is the best
+};
+
+// simulates the FIFO post-transform cache of a GPU
+VertexCacheStats simulate_vertex_cache(const int* indices, const std::vector<int>& order, const int nverts, const int cache_size=16);
+
+// Average, over nviews directions spread on the sphere, of the fragments that pass the depth test per covered pixel
+// when the mesh is drawn in the order with back-face culling and an orthographic projection.
+double measure_overdraw(const int* indices, const vec3* positions, const int nfaces, const int nverts, const std::vector<int>& order, const int nviews=16);
+
+#endif
@@ -1,49 +1,237 @@
+#include <algorithm>
 #include <iostream>
-#include <sstream>
+#include <charconv>
+#include <cstring>
+#include <filesystem>
+#include <random>
 #include "model.h"
+#include "mapped_file.h"
+#include "parallel.h"
 
-Model::Model(const std::string filename) {
-    std::ifstream in;
-    in.open (filename, std::ifstream::in);
-    if (in.fail()) return;
-    std::string line;
-    while (!in.eof()) {
-        std::getline(in, line);
-        std::istringstream iss(line.c_str());
-        char trash;
-        if (!line.compare(0, 2, "v ")) {
-            iss >> trash;
-            vec3 v;
-            for (int i=0;i<3;i++) iss >> v[i];
-            verts.push_back(v);
-        } else if (!line.compare(0, 3, "vn ")) {
-            iss >> trash >> trash;
-            vec3 n;
-            for(int i=0; i<3; i++) iss >> n[i];
-            norms.push_back(n.normalized());
-        } else if (!line.compare(0, 2, "f ")) {
-            int iF, iT, iN;
-            iss >> trash;
-            int cnt = 0;
-            while (iss >> iF >> trash >> iT >> trash >> iN) {
-                // in wavefront obj all indices start at 1, not zero
-                facet_vert.push_back(--iF);
-                facet_tex.push_back(--iT);
-                facet_norm.push_back(--iF);
-                cnt++;
+// The OBJ file is mapped and split into chunks at line boundaries. A first pass counts the elements of each chunk,
+// so that the arrays are allocated once, and a second pass parses the chunks in parallel right into their slots.
+namespace {
+    struct ObjCounts { long long v = 0, vt = 0, vn = 0, f = 0; }; // f counts triangles, polygons are split into fans
+
+    struct ObjCorner { int v, t, n; }; // resolved 0-based indices, -1 when absent or invalid
+
+    bool is_space(const char c) { return c==' ' || c=='\t' || c=='\r'; }
+
+    // skips the keyword of an OBJ line and returns its kind: 'v', 't' (vt), 'n' (vn), 'f' or 0 for anything else
+    char line_kind(const char*& p, const char* eol) {
+        while (p<eol && is_space(*p)) p++;
+        if (eol-p<2) return 0;
+        if (p[0]=='v' && is_space(p[1])) { p += 1; return 'v'; }
+        if (p[0]=='f' && is_space(p[1])) { p += 1; return 'f'; }
+        if (p[0]=='v' && (p[1]=='t' || p[1]=='n') && eol-p>2 && is_space(p[2])) { p += 2; return p[-1]; }
+        return 0;
+    }
+
+    // finds the next whitespace-separated token [p,end) of the line, comments end it
+    bool next_token(const char*& p, const char*& end, const char* eol) {
+        while (p<eol && is_space(*p)) p++;
+        if (p==eol || *p=='#') return false;
+        for (end=p; end<eol && !is_space(*end); end++);
+        return true;
+    }
+
+    real parse_real(const char*& p, const char* eol) {
+        real x = 0;
+        const char* end;
+        if (!next_token(p, end, eol)) return x;
+        std::from_chars(p + (*p=='+'), end, x);
+        p = end;
+        return x;
+    }
+
+    // OBJ indices start at 1, negative ones count back from the last element defined before the face
+    int resolve(const long long i, const long long defined, const long long total) {
+        if (i>0) return i<=total ? i-1 : -1;
+        return i<0 && -i<=defined ? defined+i : -1;
+    }
+
+    // corner of a face: v, v/t, v//n or v/t/n
+    ObjCorner parse_corner(const char* p, const char* end, const ObjCounts& defined, const ObjCounts& total) {
+        long long v = 0, t = 0, n = 0;
+        p = std::from_chars(p, end, v).ptr;
+        if (p<end && *p=='/') {
+            p = std::from_chars(p+1, end, t).ptr;
+            if (p<end && *p=='/') std::from_chars(p+1, end, n);
+        }
+        return {resolve(v, defined.v, total.v), resolve(t, defined.vt, total.vt), resolve(n, defined.vn, total.vn)};
+    }
+
+    ObjCounts count_chunk(const char* p, const char* end) {
+        ObjCounts cnt;
+        while (p<end) {
+            const char* eol = static_cast<const char*>(std::memchr(p, '\n', end-p));
+            if (!eol) eol = end;
+            switch (line_kind(p, eol)) {
+                case 'v': cnt.v++;  break;
+                case 't': cnt.vt++; break;
+                case 'n': cnt.vn++; break;
+                case 'f': {
+                    int ncorners = 0;
+                    for (const char* tok; next_token(p, tok, eol); p = tok) ncorners++;
+                    cnt.f += std::max(ncorners-2, 0);
+                }
+            }
+            p = eol+1;
+        }
+        return cnt;
+    }
+}
+
+bool Model::load_obj(const std::string filename) {
+    MappedFile file(filename);
+    if (!file.is_open()) { std::cerr << "can't open file " << filename << std::endl; return false; }
+    const char* data = file.data();
+    const size_t size = file.size();
+
+    // chunks of at least 1MB, each one starting right after a line break
+    const int nchunks = std::max<long long>(1, std::min<long long>(num_threads(), size>>20));
+    std::vector<size_t> bounds(nchunks+1, size);
+    bounds[0] = 0;
+    for (int c=1; c<nchunks; c++) {
+        const size_t from = std::max(bounds[c-1], size*c/nchunks);
+        const void* eol = std::memchr(data+from, '\n', size-from);
+        bounds[c] = eol ? static_cast<const char*>(eol) - data + 1 : size;
+    }
+
+    std::vector<ObjCounts> first(nchunks+1); // index of the first element of each kind in the chunk, the total at the end
+    parallel_chunks(nchunks, nchunks, [&](int begin, int end, int) {
+        for (int c=begin; c<end; c++) first[c+1] = count_chunk(data+bounds[c], data+bounds[c+1]);
+    });
+    for (int c=0; c<nchunks; c++) {
+        first[c+1].v  += first[c].v;
+        first[c+1].vt += first[c].vt;
+        first[c+1].vn += first[c].vn;
+        first[c+1].f  += first[c].f;
+    }
+    const ObjCounts total = first[nchunks];
+    std::vector<vec3>& verts = mesh.verts;
+    std::vector<vec3>& norms = mesh.norms;
+    std::vector<vec2>& tex_coord = mesh.tex_coord;
+    std::vector<int> &facet_vert = mesh.facet_vert, &facet_tex = mesh.facet_tex, &facet_norm = mesh.facet_norm;
+    verts.resize(total.v);
+    tex_coord.resize(total.vt);
+    norms.resize(total.vn);
+    facet_vert.resize(total.f*3);
+    facet_tex .resize(total.f*3);
+    facet_norm.resize(total.f*3);
+
+    std::vector<char> bad_vert(nchunks, 0), no_tex(nchunks, 0), no_norm(nchunks, 0);
+    parallel_chunks(nchunks, nchunks, [&](int begin, int end, int) {
+        for (int c=begin; c<end; c++) {
+            ObjCounts at = first[c];
+            for (const char *p = data+bounds[c], *chunk_end = data+bounds[c+1]; p<chunk_end; ) {
+                const char* eol = static_cast<const char*>(std::memchr(p, '\n', chunk_end-p));
+                if (!eol) eol = chunk_end;
+                switch (line_kind(p, eol)) {
+                    case 'v': for (int i=0; i<3; i++) verts[at.v][i] = parse_real(p, eol);
+                              at.v++;
+                              break;
+                    case 't': for (int i=0; i<2; i++) tex_coord[at.vt][i] = parse_real(p, eol);
+                              at.vt++;
+                              break;
+                    case 'n': for (int i=0; i<3; i++) norms[at.vn][i] = parse_real(p, eol);
+                              norms[at.vn] = norms[at.vn].normalized();
+                              at.vn++;
+                              break;
+                    case 'f': {
+                        ObjCorner fan[2];
+                        int ncorners = 0;
+                        const int first_face = at.f;
+                        bool bad = false;
+                        for (const char* tok; next_token(p, tok, eol); p = tok, ncorners++) {
+                            ObjCorner corner = parse_corner(p, tok, at, total);
+                            bad |= corner.v<0;
+                            no_tex  [c] |= corner.t<0;
+                            no_norm [c] |= corner.n<0;
+                            if (ncorners>=2) {
+                                const ObjCorner tri[3] = {fan[0], fan[1], corner};
+                                for (int j=0; j<3; j++) {
+                                    facet_vert[at.f*3+j] = tri[j].v;
+                                    facet_tex [at.f*3+j] = tri[j].t;
+                                    facet_norm[at.f*3+j] = tri[j].n;
+                                }
+                                at.f++;
+                            }
+                            fan[ncorners ? 1 : 0] = corner;
+                        }
+                        if (bad) { // the whole polygon goes, not only the triangles using the missing vertex
+                            bad_vert[c] = 1;
+                            for (int f=first_face; f<at.f; f++) facet_vert[f*3] = -1;
+                        }
+                    }
+                }
+                p = eol+1;
+            }
+        }
+    });
+
+    auto any = [](const std::vector<char>& flags) { return std::find(flags.begin(), flags.end(), 1)!=flags.end(); };
+    if (any(bad_vert)) { // the faces referencing a vertex that does not exist are dropped, the others kept in order
+        size_t kept = 0;
+        for (size_t i=0; i<facet_vert.size(); i+=3) {
+            if (facet_vert[i]<0) continue;
+            for (int j=0; j<3; j++) {
+                facet_vert[kept+j] = facet_vert[i+j];
+                facet_tex [kept+j] = facet_tex [i+j];
+                facet_norm[kept+j] = facet_norm[i+j];
             }
-            if(cnt!=3) { std::cerr << "Error: obj file is not triangulated" << std::endl; return; }
-        } else if(!line.compare(0, 3, "vt ")) {
-            iss >> trash >> trash;
-            vec2 uv;
-            for (int i=0;i<2;i++) iss >> uv[i];
-            tex_coord.push_back(uv);
+            kept += 3;
+        }
+        std::cerr << "Error: " << (facet_vert.size()-kept)/3 << " faces reference a vertex that does not exist, dropped" << std::endl;
+        facet_vert.resize(kept), facet_tex.resize(kept), facet_norm.resize(kept);
+    }
+    if (any(no_tex)) { // corners without texture coordinates get (0,0)
+        for (int& t : facet_tex) if (t<0) t = tex_coord.size();
+        tex_coord.push_back({0, 0});
+    }
+    if (any(no_norm)) { // corners without normals get the area-weighted average of the normals of the faces around the vertex
+        const int base = norms.size();
+        norms.resize(base + verts.size(), vec3{0, 0, 0});
+        for (size_t i=0; i<facet_vert.size(); i+=3) {
+            const vec3 &v0 = verts[facet_vert[i]], &v1 = verts[facet_vert[i+1]], &v2 = verts[facet_vert[i+2]];
+            const vec3 n = cross(v1-v0, v2-v0);
+            for (int j=0; j<3; j++) norms[base + facet_vert[i+j]] = norms[base + facet_vert[i+j]] + n;
         }
+        for (size_t v=base; v<norms.size(); v++) if (norms[v].norm2()>0) norms[v] = norms[v].normalized();
+        for (size_t i=0; i<facet_norm.size(); i++) if (facet_norm[i]<0) facet_norm[i] = base + facet_vert[i];
     }
+    this->verts = verts, this->norms = norms, this->tex_coord = tex_coord;
+    this->facet_vert = facet_vert, this->facet_tex = facet_tex, this->facet_norm = facet_norm;
+    return true;
+}
+
+Model::Model(const std::string filename, const bool use_cache) {
+    const size_t dot = filename.find_last_of('.');
+    const std::string base = filename.substr(0, dot);
+    const std::string sources[4] = {filename, base + "_diffuse.tga", base + "_nm_tangent.tga", base + "_spec.tga"};
+    const std::string cachefile = base + ".trmesh";
+    if (use_cache && dot!=std::string::npos && load_cache(cachefile, sources))
+        std::cerr << "mesh cache " << cachefile << " loaded" << std::endl;
+    else {
+        if (!load_obj(filename)) return;
+        if (dot!=std::string::npos) {
+            load_texture(sources[1], diffusemap );
+            load_texture(sources[2], normalmap  );
+            load_texture(sources[3], specularmap);
+        }
+        if (use_cache && dot!=std::string::npos) save_cache(cachefile, sources);
+    }
+    for (size_t i=0; i<verts.size(); i++) box.extend(verts[i]);
+    if (decode_normal_maps) decoded_normals = NormalMap(normalmap);
     std::cerr << "# v# " << nverts() << " f# "  << nfaces() << " vt# " << tex_coord.size() << " vn# " << norms.size() << std::endl;
-    load_texture(filename, "_diffuse.tga",    diffusemap );
-    load_texture(filename, "_nm_tangent.tga", normalmap  );
-    load_texture(filename, "_spec.tga",       specularmap);
+}
+
+std::size_t Model::memory() const {
+    std::size_t bytes = verts.size()*sizeof(vec3) + norms.size()*sizeof(vec3) + tex_coord.size()*sizeof(vec2)
+                      + (facet_vert.size() + facet_tex.size() + facet_norm.size())*sizeof(int);
+    for (const Texture* t : {&normalmap, &diffusemap, &specularmap})
+        if (!t->empty()) bytes += Texture::storage_size(t->width(), t->height())*sizeof(std::uint32_t);
+    return bytes + decoded_normals.memory();
 }
 
 int Model::nverts() const {
@@ -52,15 +240,16 @@ int Model::nverts() const {
 int Model::nfaces() const {
     return facet_vert.size()/3;
 }
-vec3 Model::normal(const vec2& uvf) const {
-    TGAColor c = normalmap.get(uvf[0]*normalmap.width(), uvf[1]*normalmap.height());
+vec3 Model::normal(const vec2& uvf, const Sampler& sampler) const {
+    if (!decoded_normals.empty()) return decoded_normals.sample(uvf, sampler);
+    TGAColor c = normalmap.sample(uvf, sampler);
     vec3 res;
     for (int i=0; i<3; i++)
-        res[2-i] = (double)c[i]/255.f*2.f - 1.f;
+        res[2-i] = c[i]/255.f*2.f - 1.f;
     return res;
 }
 vec3 Model::normal(const int iface, const int nthvert) const {
-    return norms[facet_vert[iface*3 + nthvert]];
+    return norms[facet_norm[iface*3 + nthvert]];
 }
 vec3 Model::vert(const int i) const {
     return verts[i];
@@ -72,14 +261,137 @@ vec2 Model::uv(const int iface, const int nthvert) const {
     return tex_coord[facet_tex[iface*3 + nthvert]];
 }
 
-const TGAColor Model::diffuse(const vec2& uvf) const {
-    return diffusemap.get(uvf[0]*diffusemap.width(), uvf[1]*diffusemap.height());
+const TGAColor Model::diffuse(const vec2& uvf, const Sampler& sampler) const {
+    return diffusemap.sample(uvf, sampler);
+}
+
+real Model::specular(const vec2& uvf, const Sampler& sampler) const {
+    return specularmap.sample(uvf, sampler)[0];
+}
+
+void Model::load_texture(const std::string texfile, Texture& texture) {
+    TGAImage image;
+    std::cerr << "texture file " << texfile << " loading " << (image.read_tga_file(texfile.c_str(), true) ? "ok" : "failed") << std::endl;
+    texture = Texture(image);
+}
+
+// The .trmesh cache is a header followed by the index and vertex arrays and the texels of the mip chains, each section
+// aligned to 64 bytes, so that a mapped cache file is used as is.
+namespace {
+    constexpr char cache_magic[8] = {'T', 'R', 'M', 'E', 'S', 'H', '\0', '\0'};
+    constexpr std::uint32_t cache_version = 2;
+    constexpr std::uint64_t cache_align = 64;
+
+    struct FileStamp {
+        std::int64_t size = -1, mtime = 0; // size -1 for a missing file
+        bool operator==(const FileStamp& s) const { return size==s.size && mtime==s.mtime; }
+    };
+
+    FileStamp file_stamp(const std::string& filename) {
+        std::error_code ec;
+        const std::uintmax_t size = std::filesystem::file_size(filename, ec);
+        if (ec) return {};
+        const auto mtime = std::filesystem::last_write_time(filename, ec);
+        if (ec) return {};
+        return {static_cast<std::int64_t>(size), static_cast<std::int64_t>(mtime.time_since_epoch().count())};
+    }
+
+    struct CacheHeader {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t real_size;    // sizeof(real) of the build that wrote the cache
+        FileStamp sources[4];       // the .obj file and the diffuse, normal and specular textures
+        std::uint64_t count[6];     // verts, norms, tex_coord, facet_vert, facet_tex, facet_norm
+        std::int32_t texture[3][2]; // width and height of the diffuse, normal and specular maps
+        std::uint64_t offset[9];    // of the six arrays and the three textures, from the start of the file
+    };
+}
+
+bool Model::load_cache(const std::string cachefile, const std::string sources[4]) {
+    auto file = std::make_unique<MappedFile>(cachefile);
+    if (!file->is_open() || file->size()<sizeof(CacheHeader)) return false;
+    CacheHeader header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) || header.version!=cache_version || header.real_size!=sizeof(real))
+        return false;
+    for (int i=0; i<4; i++)
+        if (!(header.sources[i]==file_stamp(sources[i]))) return false;
+
+    const std::uint64_t elem_size[6] = {sizeof(vec3), sizeof(vec3), sizeof(vec2), sizeof(int), sizeof(int), sizeof(int)};
+    std::uint64_t section_size[9];
+    for (int i=0; i<6; i++) section_size[i] = header.count[i]*elem_size[i];
+    for (int i=0; i<3; i++) section_size[6+i] = Texture::storage_size(header.texture[i][0], header.texture[i][1])*sizeof(std::uint32_t);
+    for (int i=0; i<9; i++)
+        if (header.offset[i]%cache_align || header.offset[i]>file->size() || section_size[i]>file->size()-header.offset[i]) return false;
+
+    // a corrupt cache with a valid header must not index out of the arrays: every face has its three corners in
+    // each index array, and every index is checked once here
+    const char* data = file->data();
+    bool valid = header.count[3]%3==0 && header.count[4]==header.count[3] && header.count[5]==header.count[3];
+    const std::uint64_t range[3] = {header.count[0], header.count[2], header.count[1]}; // vert, tex and norm indices
+    for (int i=0; valid && i<3; i++) {
+        const int* indices = reinterpret_cast<const int*>(data + header.offset[3+i]);
+        valid = std::all_of(indices, indices+header.count[3+i], [&](int k) { return k>=0 && std::uint64_t(k)<range[i]; });
+    }
+    if (!valid) {
+        std::cerr << "mesh cache " << cachefile << " is corrupt, ignored" << std::endl;
+        return false;
+    }
+    verts      = {reinterpret_cast<const vec3*>(data + header.offset[0]), header.count[0]};
+    norms      = {reinterpret_cast<const vec3*>(data + header.offset[1]), header.count[1]};
+    tex_coord  = {reinterpret_cast<const vec2*>(data + header.offset[2]), header.count[2]};
+    facet_vert = {reinterpret_cast<const int* >(data + header.offset[3]), header.count[3]};
+    facet_tex  = {reinterpret_cast<const int* >(data + header.offset[4]), header.count[4]};
+    facet_norm = {reinterpret_cast<const int* >(data + header.offset[5]), header.count[5]};
+    Texture* maps[3] = {&diffusemap, &normalmap, &specularmap};
+    for (int i=0; i<3; i++)
+        if (section_size[6+i])
+            *maps[i] = Texture(header.texture[i][0], header.texture[i][1], reinterpret_cast<const std::uint32_t*>(data + header.offset[6+i]));
+    cache = std::move(file);
+    return true;
 }
 
-void Model::load_texture(const std::string filename, const std::string suffix, TGAImage& image) {
-    size_t dot = filename.find_last_of('.');
-    if(dot==std::string::npos) return;
-    std::string texfile = filename.substr(0,dot) + suffix;
-    std::cerr << "texture file " << texfile << " loading " << (image.read_tga_file(texfile.c_str()) ? "ok" : "failed") << std::endl;
-    image.flip_vertically();
-}
\ No newline at end of file
+void Model::save_cache(const std::string cachefile, const std::string sources[4]) const {
+    CacheHeader header = {};
+    std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = cache_version;
+    header.real_size = sizeof(real);
+    for (int i=0; i<4; i++) header.sources[i] = file_stamp(sources[i]);
+
+    const Texture* maps[3] = {&diffusemap, &normalmap, &specularmap};
+    const void* section[9] = {verts.data(), norms.data(), tex_coord.data(), facet_vert.data(), facet_tex.data(), facet_norm.data(),
+                              maps[0]->texels(), maps[1]->texels(), maps[2]->texels()};
+    std::uint64_t section_size[9] = {verts.size()*sizeof(vec3), norms.size()*sizeof(vec3), tex_coord.size()*sizeof(vec2),
+                                     facet_vert.size()*sizeof(int), facet_tex.size()*sizeof(int), facet_norm.size()*sizeof(int)};
+    const std::uint64_t count[6] = {verts.size(), norms.size(), tex_coord.size(), facet_vert.size(), facet_tex.size(), facet_norm.size()};
+    std::copy(count, count+6, header.count);
+    for (int i=0; i<3; i++) {
+        header.texture[i][0] = maps[i]->width();
+        header.texture[i][1] = maps[i]->height();
+        section_size[6+i] = Texture::storage_size(maps[i]->width(), maps[i]->height())*sizeof(std::uint32_t);
+    }
+    std::uint64_t offset = sizeof(header);
+    for (int i=0; i<9; i++) {
+        offset = (offset + cache_align-1)/cache_align*cache_align;
+        header.offset[i] = offset;
+        offset += section_size[i];
+    }
+
+    // written to a temporary file and renamed, so that concurrent jobs never map a partial cache
+    const std::string tmpfile = cachefile + ".tmp" + std::to_string(std::random_device{}());
+    std::ofstream out(tmpfile, std::ios::binary);
+    if (!out.is_open()) return;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (int i=0; i<9; i++) {
+        static const char zeros[cache_align] = {};
+        out.write(zeros, header.offset[i] - (i ? header.offset[i-1]+section_size[i-1] : sizeof(header)));
+        if (section_size[i]) out.write(static_cast<const char*>(section[i]), section_size[i]);
+    }
+    out.close();
+    std::error_code ec;
+    if (out.good()) std::filesystem::rename(tmpfile, cachefile, ec);
+    if (!out.good() || ec) {
+        std::filesystem::remove(tmpfile, ec);
+        std::cerr << "can't write the mesh cache " << cachefile << std::endl;
+    }
+}
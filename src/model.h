@@ -3,31 +3,85 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <limits>
+#include <algorithm>
 #include "geometry.h"
 #include "tgaimage.h"
+#include "texture.h"
+#include "mapped_file.h"
+
+// read-only array, owned by the model or mapped from its cache file
+template<class T> struct ArrayView {
+	const T* ptr = nullptr;
+	size_t count = 0;
+	const T& operator[](const size_t i) const { return ptr[i]; }
+	const T* data() const { return ptr; }
+	size_t size() const { return count; }
+	ArrayView() = default;
+	ArrayView(const std::vector<T>& v) : ptr(v.data()), count(v.size()) {}
+	ArrayView(const T* ptr, const size_t count) : ptr(ptr), count(count) {}
+};
+
+// axis-aligned bounding box
+struct Box {
+	vec3 min, max;
+	vec3 corner(const int i) const { return {i&1 ? max.x : min.x, i&2 ? max.y : min.y, i&4 ? max.z : min.z}; }
+	void extend(const vec3 p) {
+		for (int i=0; i<3; i++) min[i] = std::min(min[i], p[i]), max[i] = std::max(max[i], p[i]);
+	}
+	void extend(const Box& b) { extend(b.min); extend(b.max); }
+	static Box empty() { return {vec3{1, 1, 1}*std::numeric_limits<real>::max(), vec3{1, 1, 1}*-std::numeric_limits<real>::max()}; }
+};
+
+// the models loaded while it is set keep a decoded copy of their normal map, twice the size of the texture, that
+// normal(uv) reads instead (see NormalMap)
+inline bool decode_normal_maps = false;
 
 class Model {
 public: 
-	Model(const std::string filename);
+	// the parsed mesh and the decoded textures are cached in a .trmesh file next to the .obj, which is rebuilt as soon
+	// as one of the source files changes
+	Model(const std::string filename, const bool use_cache=true);
 	int nverts() const;
 	int nfaces() const;
-	vec3 normal(const vec2&) const; 
+	const Box& bounds() const { return box; }
+	std::size_t memory() const; // bytes of the mesh arrays and of the textures
+	vec3 normal(const vec2&, const Sampler& sampler={}) const;
 	vec3 normal(const int, const int) const;
 	vec3 vert(const int) const;
 	vec3 vert(const int, const int) const;
+	const int* vert_indices() const { return facet_vert.data(); } // vertex of corner j of face i at [i*3+j]
+	const int* tex_indices() const { return facet_tex.data(); }
+	const int* norm_indices() const { return facet_norm.data(); }
+	const ArrayView<vec3>& positions() const { return verts; }
+	const ArrayView<vec2>& texcoords() const { return tex_coord; }
+	const ArrayView<vec3>& normals() const { return norms; }
 	vec2 uv(const int, const int) const;
-	const TGAImage& diffuse() const { return diffusemap; }
-	const TGAColor diffuse(const vec2&) const;
-	const TGAImage& specular() const { return specularmap; }
+	const Texture& diffuse() const { return diffusemap; }
+	const TGAColor diffuse(const vec2&, const Sampler& sampler={}) const;
+	const Texture& specular() const { return specularmap; }
+	real specular(const vec2&, const Sampler& sampler={}) const;
 private:
-	std::vector<vec3> verts; // array of vertices
-	std::vector<vec3> norms; // per-vertex array of normal vectors
-	std::vector<vec2> tex_coord; // per-vertex array of texcoords
-	std::vector<int> facet_vert, facet_tex, facet_norm; // per-triangle indices in the above arrays
-	TGAImage normalmap;
-	TGAImage diffusemap;
-	TGAImage specularmap;
-	void load_texture(const std::string, const std::string, TGAImage&);
+	ArrayView<vec3> verts; // array of vertices
+	ArrayView<vec3> norms; // per-vertex array of normal vectors
+	ArrayView<vec2> tex_coord; // per-vertex array of texcoords
+	ArrayView<int> facet_vert, facet_tex, facet_norm; // per-triangle indices in the above arrays
+	Texture normalmap;
+	Texture diffusemap;
+	Texture specularmap;
+	NormalMap decoded_normals; // empty unless decode_normal_maps was set
+	Box box = Box::empty();
+	struct { // storage of the arrays when the model was parsed from the .obj file
+		std::vector<vec3> verts, norms;
+		std::vector<vec2> tex_coord;
+		std::vector<int> facet_vert, facet_tex, facet_norm;
+	} mesh;
+	std::unique_ptr<MappedFile> cache; // storage of the arrays when the model was loaded from its cache
+	bool load_obj(const std::string filename);
+	bool load_cache(const std::string cachefile, const std::string sources[4]);
+	void save_cache(const std::string cachefile, const std::string sources[4]) const;
+	void load_texture(const std::string, Texture&);
 };
 
 #endif //__MODEL_H__
\ No newline at end of file
@@ -0,0 +1,63 @@
+#include <iostream>
+#include "model_cache.h"
+
+std::shared_ptr<const Model> ModelCache::get(const std::string& filename, bool& hit) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = entries.find(filename);
+    if (it!=entries.end()) {
+        hit = true;
+        counts.hits++;
+        lru.splice(lru.begin(), lru, it->second.lru);
+        std::shared_future<std::shared_ptr<const Model>> model = it->second.model;
+        lock.unlock();
+        return model.get();
+    }
+    hit = false;
+    counts.misses++;
+    std::promise<std::shared_ptr<const Model>> promise;
+    lru.push_front(filename);
+    entries[filename] = {promise.get_future().share(), 0, lru.begin()};
+    lock.unlock();
+
+    // the promise is kept whatever happens, the callers waiting for the model get null if it could not be loaded
+    std::shared_ptr<const Model> model;
+    try {
+        model = std::make_shared<const Model>(filename, use_cache);
+        if (!model->nfaces()) model = nullptr;
+    } catch (const std::exception& e) {
+        std::cerr << "can't load " + filename + ": " + e.what() + "\n";
+        model = nullptr;
+    }
+    promise.set_value(model);
+
+    lock.lock();
+    it = entries.find(filename);
+    if (!model) {
+        lru.erase(it->second.lru);
+        entries.erase(it);
+        return nullptr;
+    }
+    it->second.bytes = model->memory();
+    counts.bytes += it->second.bytes;
+    counts.models++;
+    evict(filename);
+    return model;
+}
+
+void ModelCache::evict(const std::string& keep) {
+    for (auto victim = lru.end(); counts.bytes>budget && victim!=lru.begin(); ) {
+        --victim;
+        auto it = entries.find(*victim);
+        if (*victim==keep || !it->second.bytes) continue; // the newest model, or one that is still loading
+        counts.bytes -= it->second.bytes;
+        counts.models--;
+        counts.evictions++;
+        entries.erase(it);
+        victim = lru.erase(victim);
+    }
+}
+
+ModelCache::Stats ModelCache::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counts;
+}
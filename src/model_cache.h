@@ -0,0 +1,43 @@
+#ifndef MODEL_CACHE_H
+#define MODEL_CACHE_H
+#include <cstddef>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "model.h"
+
+// Decoded models (the mesh and its textures) shared by concurrent renders. Once their total size exceeds the budget,
+// the least recently used ones are dropped; a dropped model stays alive until the renders that use it are done.
+// A model asked for while it is being loaded is loaded once, the second caller waits for the first one.
+class ModelCache {
+public:
+    struct Stats {
+        long long hits = 0, misses = 0, evictions = 0;
+        std::size_t bytes = 0; // of the models held by the cache
+        int models = 0;
+    };
+
+    explicit ModelCache(const std::size_t budget, const bool use_cache=true) : budget(budget), use_cache(use_cache) {}
+    // null if the file could not be loaded, failures are not cached
+    std::shared_ptr<const Model> get(const std::string& filename, bool& hit);
+    Stats stats() const;
+private:
+    struct Entry {
+        std::shared_future<std::shared_ptr<const Model>> model;
+        std::size_t bytes = 0; // 0 while loading
+        std::list<std::string>::iterator lru;
+    };
+    void evict(const std::string& keep); // with the lock held
+
+    const std::size_t budget;
+    const bool use_cache; // of the .trmesh files
+    mutable std::mutex mutex;
+    std::list<std::string> lru; // most recently used first
+    std::unordered_map<std::string, Entry> entries;
+    Stats counts;
+};
+
+#endif
@@ -1,13 +1,11 @@
 #include "our_gl.h"
 #include <iostream>
-mat<4,4> ModelView;
-mat<4,4> Viewport;
-mat<4,4> Projection;
+#include <algorithm>
 const float depth = 255;
 
-void viewport(int x, int y, int w, int h) {
+mat<4,4> viewport(const int x, const int y, const int w, const int h) {
     // transforms bi-unit cube [-1,1]^3 to cube [x,x+w]*[y,y+h]*[0,depth]
-    Viewport = mat<4, 4>::identity();
+    mat<4,4> Viewport = mat<4, 4>::identity();
     // scaling (ex. [-1,1] -> [-w/2, w/2])
     Viewport[0][0] = w/2.f;
     Viewport[1][1] = h/2.f;
@@ -16,15 +14,17 @@ void viewport(int x, int y, int w, int h) {
     Viewport[0][3] = x+w/2.f;
     Viewport[1][3] = y+h/2.f;
     Viewport[2][3] = depth/2.f;
+    return Viewport;
 }
 
-void projection(const double f) {
+mat<4,4> projection(const double f) {
     /*Projection = {{ {1,0,0,0}, {0,-1,0,0}, {0,0,1,0}, {0,0,f,0} }};*/
-    Projection = mat<4,4>::identity();
+    mat<4,4> Projection = mat<4,4>::identity();
     Projection[3][2] = f;
+    return Projection;
 }
 
-void lookat(const vec3 eye, const vec3 center, const vec3 up) {
+mat<4,4> lookat(const vec3 eye, const vec3 center, const vec3 up) {
     /*
     vec3 z = (center - eye).normalized();
     vec3 x = cross(up, z).normalized();
@@ -47,49 +47,162 @@ void lookat(const vec3 eye, const vec3 center, const vec3 up) {
     vec3 z = (eye-center).normalized();
     vec3 x = cross(up,z).normalized();
     vec3 y = cross(z,x).normalized();
-    ModelView = mat<4,4>::identity();
+    mat<4,4> ModelView = mat<4,4>::identity();
     for (int i=0; i<3; i++) {
         ModelView[0][i] = x[i];
         ModelView[1][i] = y[i];
         ModelView[2][i] = z[i];
         ModelView[i][3] = -center[i];
     }
+    return ModelView;
 }
 
-vec3 cartesian_to_barycentric(const vec2 tri[3], const vec2 P) {
-    // P = alpha*A + beta*B + gamma*C = (ABC)^T[alpha beta gamma] --> [alpha beta gamma] = ABC^T^-1(P)
-    mat<3,3> ABC = {{embed<3>(tri[0]), embed<3>(tri[1]), embed<3>(tri[2])}};
-    if(ABC.det()<1e-3) { return {-1,1,1}; } // throw away degenerate triangles
-    return ABC.inverse_transpose() * embed<3>(P);
+Setup setup_triangle(const vec4 clip_verts[3], const mat<4,4>& viewport, const int width, const int height, const CullMode cull, Triangle& tri) {
+    long long X[3], Y[3]; // vertices snapped to the subpixel grid
+    for (int i=0; i<3; i++) {
+        if (clip_verts[i][3]<=0) return Setup::Empty; // behind the eye, should have been clipped
+        vec4 p = viewport*clip_verts[i]/clip_verts[i][3];
+        if (!(std::abs(p[0])<=guard_band && std::abs(p[1])<=guard_band)) return Setup::Empty; // would overflow the fixed point edge functions
+        X[i] = std::llround(p[0]*subpixel_scale);
+        Y[i] = std::llround(p[1]*subpixel_scale);
+        tri.invw[i] = 1./clip_verts[i][3];
+        tri.z[i] = clip_verts[i][2];
+    }
+    tri.zmax = std::max({clip_verts[0][2], clip_verts[1][2], clip_verts[2][2]});
+
+    // edge function i is twice the signed area of (P, v[i+1], v[i+2]), positive inside for counterclockwise triangles
+    long long A[3], B[3], C[3], area2 = 0;
+    for (int i=0; i<3; i++) {
+        int j = (i+1)%3, k = (i+2)%3;
+        A[i] = Y[j]-Y[k];
+        B[i] = X[k]-X[j];
+        C[i] = X[j]*Y[k]-X[k]*Y[j];
+        area2 += C[i];
+    }
+    if (!area2) return Setup::Empty;
+    if ((area2<0 && cull==CullMode::Back) || (area2>0 && cull==CullMode::Front)) return Setup::Culled;
+    const long long sign = area2>0 ? 1 : -1; // clockwise triangles get their edge functions flipped to be positive inside
+    for (int i=0; i<3; i++) {
+        tri.a[i] = sign*A[i]*subpixel_scale;
+        tri.b[i] = sign*B[i]*subpixel_scale;
+        tri.c[i] = sign*C[i];
+        // top-left fill rule: pixels lying exactly on an edge belong to the triangle only if it is a left or top edge
+        tri.threshold[i] = (sign*A[i]>0 || (A[i]==0 && sign*B[i]<0)) ? 0 : 1;
+    }
+
+    // samples are taken at integer pixel coordinates
+    tri.bbox.xmin = std::max<long long>(ceil_div (std::min({X[0], X[1], X[2]}), subpixel_scale), 0);
+    tri.bbox.ymin = std::max<long long>(ceil_div (std::min({Y[0], Y[1], Y[2]}), subpixel_scale), 0);
+    tri.bbox.xmax = std::min<long long>(floor_div(std::max({X[0], X[1], X[2]}), subpixel_scale), width-1);
+    tri.bbox.ymax = std::min<long long>(floor_div(std::max({Y[0], Y[1], Y[2]}), subpixel_scale), height-1);
+    return tri.bbox.xmin<=tri.bbox.xmax && tri.bbox.ymin<=tri.bbox.ymax ? Setup::Visible : Setup::Empty;
+}
+
+Frustum::Frustum(const mat<4,4>& viewport, const int width, const int height) {
+    const real x0 = (0     - viewport[0][3])/viewport[0][0], x1 = (width  - viewport[0][3])/viewport[0][0];
+    const real y0 = (0     - viewport[1][3])/viewport[1][1], y1 = (height - viewport[1][3])/viewport[1][1];
+    xmin = std::min(x0, x1), xmax = std::max(x0, x1);
+    ymin = std::min(y0, y1), ymax = std::max(y0, y1);
 }
 
-void triangle(const vec4 clip_verts[3], IShader& shader, TGAImage& image, std::vector<double>& zbuffer) {
-    // pts2 are vertices on screen space
-    vec4 pts[3] = {Viewport*clip_verts[0], Viewport*clip_verts[1], Viewport*clip_verts[2]}; // before perspective division
-    vec2 pts2[3] =  {proj<2>(pts[0]/pts[0][3]), proj<2>(pts[1]/pts[1][3]), proj<2>(pts[2]/pts[2][3])}; // after perspective division
-
-    // find the bounding box for the triangle
-    int bboxmin[2] = {image.width()-1, image.height()-1};
-    int bboxmax[2] = {0, 0};
-    for(int i=0; i<3; i++) {
-        for(int j=0; j<2; j++) {
-            bboxmin[j] = std::min(bboxmin[j], static_cast<int>(pts2[i][j]));
-            bboxmax[j] = std::max(bboxmax[j], static_cast<int>(pts2[i][j]));
+struct ClipVertex {
+    vec4 p;   // clip coordinates
+    vec3 bar; // barycentric coordinates inside the face
+};
+
+void assemble_triangle(const vec4 clip_verts[3], const int iface, const mat<4,4>& viewport, const int width, const int height, const CullMode cull, std::vector<Triangle>& out, DrawStats& stats) {
+    stats.triangles++;
+    // trivial reject: all the vertices are behind the eye or outside of the same image border
+    const Frustum frustum(viewport, width, height);
+    if (frustum.outcode(clip_verts[0]) & frustum.outcode(clip_verts[1]) & frustum.outcode(clip_verts[2])) {
+        stats.rejected++;
+        return;
+    }
+
+    // the guard band in normalized device coordinates, the clipper only cuts the triangles that go beyond it;
+    // it clips to half of the band so that the rounding errors do not push the new vertices out of it
+    const real gx = (guard_band/2 - std::abs(viewport[0][3]))/std::abs(viewport[0][0]);
+    const real gy = (guard_band/2 - std::abs(viewport[1][3]))/std::abs(viewport[1][1]);
+    auto distance = [gx, gy](const vec4& v, int plane) { // signed distance to a clipping plane, positive inside
+        switch (plane) {
+            case 0:  return v[3] - near_w;
+            case 1:  return gx*v[3] - v[0];
+            case 2:  return gx*v[3] + v[0];
+            case 3:  return gy*v[3] - v[1];
+            default: return gy*v[3] + v[1];
         }
+    };
+    unsigned planes = 0;
+    for (int i=0; i<3; i++)
+        for (int p=0; p<5; p++)
+            if (distance(clip_verts[i], p)<0) planes |= 1u<<p;
+
+    Triangle tri;
+    tri.face = iface;
+    tri.clipped = false;
+    if (!planes) {
+        Setup res = setup_triangle(clip_verts, viewport, width, height, cull, tri);
+        if (res==Setup::Visible) { out.push_back(tri); stats.drawn++; }
+        if (res==Setup::Culled) stats.culled++;
+        return;
     }
 
-    // for each pixel in the bounding box
-    for(int x=std::max(bboxmin[0], 0); x<=std::min(bboxmax[0], image.width()-1); x++) {
-        for(int y=std::max(bboxmin[1], 0); y<=std::min(bboxmax[1], image.height()-1); y++) {
-            vec3 bc_screen = cartesian_to_barycentric(pts2, {static_cast<double>(x), static_cast<double>(y)});
-            vec3 bc_clip = {bc_screen.x/pts[0][3], bc_screen.y/pts[1][3], bc_screen.z/pts[2][3]};
-            bc_clip = bc_clip / (bc_clip.x + bc_clip.y + bc_clip.z);
-            double frag_depth = bc_clip * vec3{clip_verts[0][2], clip_verts[1][2], clip_verts[2][2]};
-            if(bc_screen.x<0 || bc_screen.y<0 || bc_screen.z<0 || zbuffer[x+y*image.width()] > frag_depth) continue;
-            TGAColor color;
-            if(shader.fragment(bc_clip, color)) continue;
-            zbuffer[x+y*image.width()] = frag_depth;
-            image.set(x, y, color);
+    // Sutherland-Hodgman against the near plane and the guard band, the polygon is then split into a fan
+    stats.clipped++;
+    ClipVertex poly[8], tmp[8];
+    int n = 3;
+    for (int i=0; i<3; i++) {
+        poly[i].p = clip_verts[i];
+        poly[i].bar = {};
+        poly[i].bar[i] = 1;
+    }
+    for (int p=0; p<5 && n>=3; p++) {
+        if (!(planes>>p & 1)) continue;
+        int m = 0;
+        for (int k=0; k<n; k++) {
+            const ClipVertex &a = poly[k], &b = poly[(k+1)%n];
+            real da = distance(a.p, p), db = distance(b.p, p);
+            if (da>=0) tmp[m++] = a;
+            if ((da>=0) != (db>=0)) {
+                real t = da/(da-db);
+                tmp[m++] = {a.p + (b.p-a.p)*t, a.bar + (b.bar-a.bar)*t};
+            }
         }
+        std::copy(tmp, tmp+m, poly);
+        n = m;
+    }
+    tri.clipped = true;
+    bool culled = false, drawn = false;
+    for (int k=1; k+1<n; k++) {
+        const vec4 verts[3] = {poly[0].p, poly[k].p, poly[k+1].p};
+        Setup res = setup_triangle(verts, viewport, width, height, cull, tri);
+        culled |= res==Setup::Culled;
+        if (res!=Setup::Visible) continue;
+        tri.bar[0] = poly[0].bar, tri.bar[1] = poly[k].bar, tri.bar[2] = poly[k+1].bar;
+        out.push_back(tri);
+        stats.drawn++;
+        drawn = true;
     }
-}
\ No newline at end of file
+    if (culled && !drawn) stats.culled++;
+}
+
+FragmentCounts triangle(const vec4 clip_verts[3], const mat<4,4>& viewport, IShader& shader, RenderTarget& target, DepthBuffer& zbuffer, const CullMode cull) {
+    std::vector<Triangle> tris;
+    DrawStats stats;
+    assemble_triangle(clip_verts, 0, viewport, target.width(), target.height(), cull, tris, stats);
+    FragmentCounts counts;
+    for (const Triangle& tri : tris)
+        counts += triangle(tri, shader, target, zbuffer, tri.bbox);
+    return counts;
+}
+
+FragmentCounts triangle(const Triangle& tri, const std::uint32_t id, VisibilityBuffer& vbuffer, DepthBuffer& zbuffer, const Rect& scissor) {
+    return rasterize(tri, zbuffer, scissor, [&](int x, int y, unsigned mask, const real bar[3][block_size]) {
+        for (int k=0; k<block_size; k++) {
+            if (!(mask>>k & 1)) continue;
+            vbuffer.id [x+k+y*vbuffer.width] = id;
+            vbuffer.bar[x+k+y*vbuffer.width] = {bar[0][k], bar[1][k], bar[2][k]};
+        }
+        return mask;
+    });
+}
@@ -1,19 +1,396 @@
 #ifndef OUR_GL_H
 #define OUR_GL_H
-#include "tgaimage.h"
+#include <type_traits>
+#include <vector>
+#include "render_target.h"
 #include "geometry.h"
+#include "parallel.h"
+#include "zbuffer.h"
+#include "raster.h"
 
-extern mat<4, 4> ModelView, Projection, Viewport;
-
-void viewport(const int, const int, const int, const int);
-void projection(double coeff=0); // coeff = -1/c
-void lookat(const vec3 eye, const vec3 center, const vec3 up);
+// The transforms are plain values, the draws take the viewport in their DrawOptions and the shaders get the rest as
+// uniforms, so that several draws can run at the same time.
+mat<4,4> viewport(const int x, const int y, const int w, const int h); // bi-unit cube to [x,x+w]*[y,y+h]*[0,depth]
+mat<4,4> projection(const double coeff=0); // coeff = -1/c
+mat<4,4> lookat(const vec3 eye, const vec3 center, const vec3 up); // model view
 
+// A shader is any type with the two members below. draw() and triangle() are templates over the shader type, so the
+// shader is inlined into the raster loop. A shader may also shade a whole depth tile row of fragments at once with
+//     unsigned fragments(unsigned mask, const real bar[3][block_size], TGAColor color[block_size]);
+// which gets the bit mask of the fragments to shade and returns the mask of the ones that are not discarded.
+// A shader that keeps its per-face state apart, in a member varyings of type Shader::Varyings, is copied once per thread
+// by the draws, which store the Varyings of every face instead of a copy of the whole shader per face.
+// IShader is the dynamically dispatched version for ad-hoc shaders.
 struct IShader {
     virtual vec4 vertex(int iface, int nthvert) = 0;
-    virtual bool fragment(vec3 bar, TGAColor& color) = 0;
+    virtual bool fragment(vec3 bar, TGAColor& color) = 0; // returns true to discard the fragment
 };
 
-void triangle(const vec4 clip_verts[3], IShader& shader, TGAImage& image, std::vector<double>& zbuffer);
+template<class Shader, class = void>
+struct has_block_fragments : std::false_type {};
+template<class Shader>
+struct has_block_fragments<Shader, std::void_t<decltype(std::declval<Shader&>().fragments(0u, std::declval<const real(&)[3][block_size]>(), std::declval<TGAColor*>()))>> : std::true_type {};
+
+// per-face state of a shader: its Varyings, or the whole shader if it does not declare them
+template<class Shader, class = void>
+struct shader_varyings { using type = Shader; };
+template<class Shader>
+struct shader_varyings<Shader, std::void_t<typename Shader::Varyings>> { using type = typename Shader::Varyings; };
+
+// runs the fragment stage on the fragments of the mask, returns the mask of the ones that were not discarded
+template<class Shader>
+unsigned shade_fragments(Shader& shader, const unsigned mask, const real bar[3][block_size], TGAColor color[block_size]) {
+    if constexpr (has_block_fragments<Shader>::value) {
+        return shader.fragments(mask, bar, color);
+    } else {
+        unsigned kept = 0;
+        for (int k=0; k<block_size; k++)
+            if (mask>>k & 1 && !shader.fragment(vec3{bar[0][k], bar[1][k], bar[2][k]}, color[k])) kept |= 1u<<k;
+        return kept;
+    }
+}
+
+// Visibility buffer of the deferred mode: which face covers each pixel and where. The deferred draws leave it empty,
+// their resolve pass clears the ids it reads, so that one buffer serves all the draws of a frame and all the frames.
+struct VisibilityBuffer {
+    int width, height;
+    std::vector<std::uint32_t> id; // index of the face plus one, 0 for empty pixels
+    std::vector<vec3> bar;         // perspective-correct barycentric coordinates inside the face
+    VisibilityBuffer(const int w=0, const int h=0) : width(w), height(h), id(w*h, 0), bar(w*h) {}
+};
+
+// one face drawn on its own, culled like the faces of draw() with the same cull mode
+FragmentCounts triangle(const vec4 clip_verts[3], const mat<4,4>& viewport, IShader& shader, RenderTarget& target, DepthBuffer& zbuffer, const CullMode cull=CullMode::Back);
+
+// rasterizes a triangle that went through setup_triangle(), only the pixels inside the scissor rectangle are touched
+template<class Shader>
+FragmentCounts triangle(const Triangle& tri, Shader& shader, RenderTarget& target, DepthBuffer& zbuffer, const Rect& scissor) {
+    return rasterize(tri, zbuffer, scissor, [&](int x, int y, unsigned mask, const real bar[3][block_size]) {
+        PROFILE_NESTED(Fragment, Raster);
+        TGAColor color[block_size];
+        unsigned kept = shade_fragments(shader, mask, bar, color);
+        std::uint32_t* dst = target.row(x, y); // the block is a tile row of the target, the select compiles to a blend
+        for (int k=0; k<block_size; k++)
+            dst[k] = kept>>k & 1 ? RenderTarget::pack(color[k]) : dst[k];
+        return kept;
+    });
+}
+
+// same, but the fragment shader is not run: the triangle id and the barycentrics go to the visibility buffer
+FragmentCounts triangle(const Triangle& tri, const std::uint32_t id, VisibilityBuffer& vbuffer, DepthBuffer& zbuffer, const Rect& scissor);
+
+constexpr int tile_size = 64; // side of the screen tiles the binned renderer distributes among threads, a multiple of DepthBuffer::tile
+
+// Forward mode shades every fragment that passes the depth test at the time it is drawn. Deferred mode first rasterizes
+// triangle ids and barycentrics only, then runs the fragment shader once per visible pixel. Both give the same image
+// as long as the shader does not discard: a discarded fragment in deferred mode still occludes what is behind it.
+enum class ShadingMode { Forward, Deferred };
+
+struct DrawOptions {
+    mat<4,4> viewport = mat<4,4>::identity(); // normalized device to screen coordinates, see viewport()
+    ShadingMode shading = ShadingMode::Forward;
+    CullMode cull = CullMode::Back;
+    bool zprepass = false; // forward mode: fills the depth of every tile before shading it, so that only visible fragments are shaded
+    int nthreads = num_threads();
+    VisibilityBuffer* vbuffer = nullptr; // deferred mode: reused from draw to draw and resized as needed, or one per draw if null
+};
+
+struct DrawStats {
+    long long corners = 0;      // face corners, i.e. vertex shader invocations of a non-indexed draw
+    long long vertices = 0;     // vertex shader invocations
+    long long triangles = 0;    // faces submitted to primitive assembly
+    long long rejected = 0;     // faces entirely outside of the view frustum
+    long long culled = 0;       // back (or front) faces
+    long long clipped = 0;      // faces cut by the near plane or the guard band
+    long long drawn = 0;        // triangles sent to the rasterizer, after clipping
+    long long tested = 0;       // covered pixels that went through the depth test
+    long long depth_passed = 0; // fragments that passed the depth test during rasterization
+    long long shaded = 0;       // fragment shader invocations
+    long long discarded = 0;    // fragments discarded by the shader
+
+    DrawStats& operator+=(const DrawStats& s) {
+        corners += s.corners, vertices += s.vertices, triangles += s.triangles, rejected += s.rejected, culled += s.culled;
+        clipped += s.clipped, drawn += s.drawn;
+        tested += s.tested, depth_passed += s.depth_passed, shaded += s.shaded, discarded += s.discarded;
+        return *this;
+    }
+};
+
+// The view frustum in clip coordinates: the viewport does not necessarily span the whole image, so its side planes are
+// those of the image borders and not the [-1,1] cube, then there is the near plane
+struct Frustum {
+    real xmin, xmax, ymin, ymax; // image borders in normalized device coordinates
+    Frustum(const mat<4,4>& viewport, const int width, const int height);
+    // bit mask of the planes the point is outside of
+    unsigned outcode(const vec4& v) const {
+        return (v[0]>xmax*v[3]) | (v[0]<xmin*v[3])<<1 | (v[1]>ymax*v[3])<<2 | (v[1]<ymin*v[3])<<3 | (v[3]<near_w)<<4;
+    }
+};
+
+// Primitive assembly: rejects the face if it lies outside of the view frustum, culls it according to its orientation,
+// clips it against the near plane and the guard band if needed, and appends the resulting triangles to out.
+void assemble_triangle(const vec4 clip_verts[3], const int iface, const mat<4,4>& viewport, const int width, const int height, const CullMode cull, std::vector<Triangle>& out, DrawStats& stats);
+
+// Triangles of a draw after primitive assembly, binned into screen tiles. Every chunk of faces fills its own bins, so
+// walking the chunks in order keeps the submission order.
+struct TileBins {
+    int width, height, tiles_x, tiles_y, nchunks;
+    // per chunk of faces: the triangles, and their indices grouped by tile, the ones of tile t are
+    // items[first[t]..first[t+1])
+    std::vector<std::vector<Triangle>> tris;
+    std::vector<std::vector<int>> first, items;
+    DrawStats stats;
+
+    int ntiles() const { return tiles_x*tiles_y; }
+
+    Rect scissor(const int tile) const {
+        int x = tile%tiles_x*tile_size, y = tile/tiles_x*tile_size;
+        return Rect{x, y, std::min(x+tile_size, width)-1, std::min(y+tile_size, height)-1};
+    }
+
+    bool empty(const int tile) const {
+        for (int c=0; c<nchunks; c++)
+            if (first[c][tile]<first[c][tile+1]) return false;
+        return true;
+    }
+
+    // calls fn(tri) for every triangle overlapping the tile, in submission order
+    template<class F>
+    void for_each(const int tile, F&& fn) const {
+        for (int c=0; c<nchunks; c++)
+            for (int i=first[c][tile]; i<first[c][tile+1]; i++) fn(tris[c][items[c][i]]);
+    }
+};
+
+// the bins of the calling thread, kept from one draw to the next so that their memory is only allocated once
+inline TileBins& tile_bins() {
+    static thread_local TileBins b{};
+    return b;
+}
+
+// Front end shared by the draw functions: assemble(iface, clip_verts, chunk) runs the vertex stage of a face, then the face
+// goes through primitive assembly and the resulting triangles are binned. The faces are split into a chunk per thread.
+// The bins returned are those of tile_bins(), valid until the next draw on this thread.
+template<class Assemble>
+const TileBins& bin_faces(const int nfaces, const int width, const int height, const DrawOptions& options, Assemble&& assemble) {
+    const int nchunks = std::max(1, std::min(options.nthreads, nfaces));
+    TileBins& b = tile_bins();
+    b.width = width;
+    b.height = height;
+    b.tiles_x = (width+tile_size-1)/tile_size;
+    b.tiles_y = (height+tile_size-1)/tile_size;
+    b.nchunks = nchunks;
+    b.stats = {};
+    if (static_cast<int>(b.tris.size())<nchunks) {
+        b.tris.resize(nchunks);
+        b.first.resize(nchunks);
+        b.items.resize(nchunks);
+    }
+    std::vector<DrawStats> chunk_stats(nchunks);
+    parallel_chunks(nfaces, nchunks, [&](int begin, int end, int chunk) {
+        PROFILE_SCOPE(Setup, chunk);
+        std::vector<Triangle>& tris = b.tris[chunk];
+        tris.clear();
+        for (int i=begin; i<end; i++) {
+            vec4 clip_verts[3];
+            {
+                PROFILE_NESTED(Vertex, Setup);
+                assemble(i, clip_verts, chunk);
+            }
+            assemble_triangle(clip_verts, i, options.viewport, width, height, options.cull, tris, chunk_stats[chunk]);
+        }
+        // counting sort of the triangles by tile, they stay in submission order within a tile
+        std::vector<int>& first = b.first[chunk];
+        std::vector<int>& items = b.items[chunk];
+        first.assign(b.ntiles()+1, 0);
+        auto for_tiles = [&b](const Rect& bbox, auto&& fn) {
+            for (int ty=bbox.ymin/tile_size; ty<=bbox.ymax/tile_size; ty++)
+                for (int tx=bbox.xmin/tile_size; tx<=bbox.xmax/tile_size; tx++)
+                    fn(tx+ty*b.tiles_x);
+        };
+        for (const Triangle& tri : tris)
+            for_tiles(tri.bbox, [&](int tile) { first[tile+1]++; });
+        for (int t=0; t<b.ntiles(); t++) first[t+1] += first[t];
+        items.resize(first.back());
+        for (int t=0; t<static_cast<int>(tris.size()); t++)
+            for_tiles(tris[t].bbox, [&](int tile) { items[first[tile]++] = t; });
+        // the fill left first[t] at the end of tile t, i.e. the start of tile t+1
+        for (int t=b.ntiles(); t>0; t--) first[t] = first[t-1];
+        first[0] = 0;
+    });
+    for (const DrawStats& s : chunk_stats) b.stats += s;
+    b.stats.corners = 3ll*nfaces;
+    return b;
+}
+
+// Back end shared by the shaded draw functions: assemble(shader, iface, clip_verts) runs the vertex stage of a face on a
+// copy of the shader owned by the thread, and the varyings it leaves are kept per face. Every tile is then rasterized by
+// a single thread in submission order, so no locks are needed and the image is identical to the one drawn face by face
+// with triangle().
+template<class Shader, class Assemble>
+DrawStats draw_faces(const int nfaces, const Shader& shader, Assemble&& assemble, RenderTarget& target, DepthBuffer& zbuffer, const DrawOptions& options) {
+    using Varyings = typename shader_varyings<Shader>::type;
+    constexpr bool split = !std::is_same<Varyings, Shader>::value;
+    const int nthreads = options.nthreads;
+    std::vector<Shader> local(split ? nthreads : 0, shader); // uniforms, and the varyings of the last face bound
+    std::vector<int> bound(nthreads, -1);
+    std::vector<Varyings> varyings;
+    if constexpr (split) varyings.assign(nfaces, shader.varyings);
+    else varyings.assign(nfaces, shader);
+    const TileBins& bins = bin_faces(nfaces, target.width(), target.height(), options, [&](int iface, vec4 clip_verts[3], int chunk) {
+        if constexpr (split) {
+            assemble(local[chunk], iface, clip_verts);
+            varyings[iface] = local[chunk].varyings;
+        } else assemble(varyings[iface], iface, clip_verts);
+    });
+    // the shader of a face for a thread, the faces of a tile come in runs so the varyings are seldom copied
+    auto face_shader = [&](const int thread, const int iface) -> Shader& {
+        if constexpr (split) {
+            if (bound[thread]!=iface) local[thread].varyings = varyings[iface], bound[thread] = iface;
+            return local[thread];
+        } else return varyings[iface];
+    };
+
+    // rasterization, the tiles are disjoint so the threads never touch the same pixel
+    std::vector<FragmentCounts> counts(nthreads);
+    std::vector<long long> shaded(nthreads, 0);
+    if (options.shading==ShadingMode::Forward) {
+        parallel_for(bins.ntiles(), nthreads, [&](int tile, int thread) {
+            PROFILE_SCOPE(Raster, thread);
+            const Rect scissor = bins.scissor(tile);
+            if (options.zprepass)
+                bins.for_each(tile, [&](const Triangle& tri) { rasterize_depth(tri, zbuffer, scissor); });
+            bins.for_each(tile, [&](const Triangle& tri) {
+                counts[thread] += triangle(tri, face_shader(thread, tri.face), target, zbuffer, scissor);
+            });
+        });
+        for (int t=0; t<nthreads; t++) shaded[t] = counts[t].passed;
+    } else {
+        // visibility pass, then a resolve pass that shades each visible pixel once
+        VisibilityBuffer local;
+        VisibilityBuffer& vbuffer = options.vbuffer ? *options.vbuffer : local;
+        if (vbuffer.width!=target.width() || vbuffer.height!=target.height()) vbuffer = VisibilityBuffer(target.width(), target.height());
+        parallel_for(bins.ntiles(), nthreads, [&](int tile, int thread) {
+            PROFILE_SCOPE(Raster, thread);
+            const Rect scissor = bins.scissor(tile);
+            bins.for_each(tile, [&](const Triangle& tri) {
+                counts[thread] += triangle(tri, tri.face+1, vbuffer, zbuffer, scissor);
+            });
+        });
+        // the kept counts of the visibility pass are meaningless, the discards happen here
+        for (int t=0; t<nthreads; t++) counts[t].kept = 0;
+        parallel_for(bins.ntiles(), nthreads, [&](int tile, int thread) {
+            if (bins.empty(tile)) return; // no id of this draw, and the buffer came in empty
+            PROFILE_SCOPE(Fragment, thread);
+            Rect r = bins.scissor(tile);
+            for (int y=r.ymin; y<=r.ymax; y++)
+                for (int x=r.xmin; x<=r.xmax; x++) {
+                    const std::uint32_t id = vbuffer.id[x+y*target.width()];
+                    if (!id) continue;
+                    vbuffer.id[x+y*target.width()] = 0;
+                    TGAColor color;
+                    shaded[thread]++;
+                    if (face_shader(thread, id-1).fragment(vbuffer.bar[x+y*target.width()], color)) continue;
+                    target.set(x, y, color);
+                    counts[thread].kept++;
+                }
+        });
+    }
+    DrawStats stats = bins.stats;
+    for (int t=0; t<nthreads; t++) {
+        stats.tested += counts[t].tested;
+        stats.depth_passed += counts[t].passed;
+        stats.shaded += shaded[t];
+        stats.discarded += shaded[t] - counts[t].kept;
+    }
+    return stats;
+}
+
+// post-transform vertex buffer of the indexed draws, vertex(ivert) is called once per vertex
+template<class Vertex>
+std::vector<vec4> transform_vertices(const int nverts, Vertex&& vertex, const DrawOptions& options) {
+    std::vector<vec4> transformed(nverts);
+    parallel_chunks(nverts, std::max(1, std::min(options.nthreads, nverts/1024)), [&](int begin, int end, int chunk) {
+        PROFILE_SCOPE(Vertex, chunk);
+        for (int v=begin; v<end; v++)
+            transformed[v] = vertex(v);
+    });
+    return transformed;
+}
+
+// Draws faces [0,nfaces), shader.vertex(iface, nthvert) is called for every corner.
+template<class Shader>
+DrawStats draw(const int nfaces, const Shader& shader, RenderTarget& target, DepthBuffer& zbuffer, const DrawOptions& options={}) {
+    DrawStats stats = draw_faces(nfaces, shader, [](Shader& s, int iface, vec4 clip_verts[3]) {
+        for (int j=0; j<3; j++)
+            clip_verts[j] = s.vertex(iface, j);
+    }, target, zbuffer, options);
+    stats.vertices = stats.corners;
+    return stats;
+}
+
+// Indexed draw, indices[iface*3+nthvert] is the vertex of a face corner. The vertex stage transforms each of the nverts
+// vertices once with shader.vertex(ivert), which must not modify the shader, into a post-transform buffer that is
+// shared by all the faces. The per-corner varyings are set up afterwards by shader.varying(iface, nthvert, gl_Position).
+template<class Shader>
+DrawStats draw_indexed(const int* indices, const int nfaces, const int nverts, const Shader& shader, RenderTarget& target, DepthBuffer& zbuffer, const DrawOptions& options={}) {
+    const std::vector<vec4> transformed = transform_vertices(nverts, [&](int v) { return shader.vertex(v); }, options);
+    DrawStats stats = draw_faces(nfaces, shader, [&](Shader& s, int iface, vec4 clip_verts[3]) {
+        for (int j=0; j<3; j++) {
+            clip_verts[j] = transformed[indices[iface*3+j]];
+            s.varying(iface, j, clip_verts[j]);
+        }
+    }, target, zbuffer, options);
+    stats.vertices = nverts;
+    return stats;
+}
+
+// Depth-only indexed draw for shadow maps and depth pre-passes: vertex(ivert) returns the clip coordinates of a vertex,
+// there are no varyings, no fragment stage and no color buffer.
+template<class Vertex>
+DrawStats draw_depth(const int* indices, const int nfaces, const int nverts, Vertex&& vertex, DepthBuffer& zbuffer, const DrawOptions& options={}) {
+    const std::vector<vec4> transformed = transform_vertices(nverts, vertex, options);
+    const TileBins& bins = bin_faces(nfaces, zbuffer.width(), zbuffer.height(), options, [&](int iface, vec4 clip_verts[3], int) {
+        for (int j=0; j<3; j++)
+            clip_verts[j] = transformed[indices[iface*3+j]];
+    });
+    std::vector<FragmentCounts> counts(options.nthreads);
+    parallel_for(bins.ntiles(), options.nthreads, [&](int tile, int thread) {
+        PROFILE_SCOPE(Raster, thread);
+        const Rect scissor = bins.scissor(tile);
+        bins.for_each(tile, [&](const Triangle& tri) { counts[thread] += rasterize_depth(tri, zbuffer, scissor); });
+    });
+    DrawStats stats = bins.stats;
+    stats.vertices = nverts;
+    for (const FragmentCounts& c : counts) {
+        stats.tested += c.tested;
+        stats.depth_passed += c.passed;
+    }
+    return stats;
+}
+
+// Visibility-only indexed draw: vertex(ivert) returns the clip coordinates of a vertex and face iface goes to vbuffer with
+// the id first_id+iface+1, so that the draws of several meshes can share it. The visible pixels are shaded afterwards.
+template<class Vertex>
+DrawStats draw_visibility(const int* indices, const int nfaces, const int nverts, Vertex&& vertex, const std::uint32_t first_id, VisibilityBuffer& vbuffer, DepthBuffer& zbuffer, const DrawOptions& options={}) {
+    const std::vector<vec4> transformed = transform_vertices(nverts, vertex, options);
+    const TileBins& bins = bin_faces(nfaces, zbuffer.width(), zbuffer.height(), options, [&](int iface, vec4 clip_verts[3], int) {
+        for (int j=0; j<3; j++)
+            clip_verts[j] = transformed[indices[iface*3+j]];
+    });
+    std::vector<FragmentCounts> counts(options.nthreads);
+    parallel_for(bins.ntiles(), options.nthreads, [&](int tile, int thread) {
+        PROFILE_SCOPE(Raster, thread);
+        const Rect scissor = bins.scissor(tile);
+        bins.for_each(tile, [&](const Triangle& tri) { counts[thread] += triangle(tri, first_id+tri.face+1, vbuffer, zbuffer, scissor); });
+    });
+    DrawStats stats = bins.stats;
+    stats.vertices = nverts;
+    for (const FragmentCounts& c : counts) {
+        stats.tested += c.tested;
+        stats.depth_passed += c.passed;
+    }
+    return stats;
+}
 
 #endif
@@ -0,0 +1,57 @@
+#include "parallel.h"
+
+ThreadPool& ThreadPool::instance() {
+    static ThreadPool pool;
+    return pool;
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    wake.notify_all();
+    for (std::thread& t : workers) t.join();
+}
+
+// runs the next task of the job, called and returns with the lock held
+void ThreadPool::take(Job& job, std::unique_lock<std::mutex>& lock) {
+    const int task = job.next++;
+    if (job.next==job.ntasks) jobs.erase(std::find(jobs.begin(), jobs.end(), &job));
+    lock.unlock();
+    std::exception_ptr error;
+    try {
+        job.call(job.fn, task);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    lock.lock();
+    if (error && !job.error) job.error = error;
+    if (++job.done==job.ntasks) finished.notify_all();
+}
+
+void ThreadPool::run_tasks(const int ntasks, const int nthreads, void (*call)(void*, int), void* fn) {
+    Job job{call, fn, ntasks, 0, 0, {}};
+    std::unique_lock<std::mutex> lock(mutex);
+    while (static_cast<int>(workers.size())<nthreads-1)
+        workers.emplace_back(&ThreadPool::worker, this);
+    jobs.push_back(&job);
+    lock.unlock();
+    wake.notify_all();
+
+    // the caller takes the tasks of its own job until none are left
+    lock.lock();
+    while (job.next<ntasks) take(job, lock);
+    finished.wait(lock, [&job]() { return job.done==job.ntasks; });
+    lock.unlock();
+    if (job.error) std::rethrow_exception(job.error);
+}
+
+void ThreadPool::worker() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        wake.wait(lock, [this]() { return stop || !jobs.empty(); });
+        if (stop) return;
+        take(*jobs.front(), lock);
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// number of worker threads used by the renderer (0 = one per hardware thread)
+inline int render_threads = 0;
+
+inline int num_threads() {
+    if (render_threads>0) return render_threads;
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Worker threads kept for the whole run, the parallel loops below hand their tasks to them instead of starting threads
+// of their own. The calling thread works on its own job too and returns once all of its tasks are done, so loops may
+// be started from several threads at once (the render server) or from inside a task. The pool grows to the largest
+// thread count asked for.
+class ThreadPool {
+public:
+    static ThreadPool& instance();
+    ~ThreadPool();
+
+    // calls fn(task) once for every task in [0,ntasks), on nthreads threads at most counting the caller; an exception
+    // thrown by a task is rethrown here
+    template<class F>
+    void run(const int ntasks, const int nthreads, F&& fn) {
+        using Fn = std::remove_reference_t<F>;
+        run_tasks(ntasks, nthreads, [](void* f, int task) { (*static_cast<Fn*>(f))(task); }, const_cast<void*>(static_cast<const void*>(&fn)));
+    }
+private:
+    struct Job {
+        void (*call)(void*, int);
+        void* fn;
+        int ntasks;
+        int next = 0;          // first task not taken yet
+        int done = 0;          // tasks finished
+        std::exception_ptr error;
+    };
+    ThreadPool() = default;
+    void run_tasks(const int ntasks, const int nthreads, void (*call)(void*, int), void* fn);
+    void take(Job& job, std::unique_lock<std::mutex>& lock);
+    void worker();
+
+    std::mutex mutex;
+    std::condition_variable wake, finished;
+    std::deque<Job*> jobs; // with tasks left to take
+    std::vector<std::thread> workers;
+    bool stop = false;
+};
+
+// splits [0,n) into nchunks contiguous ranges and calls fn(begin, end, chunk) for each of them in parallel
+template<class F>
+void parallel_chunks(const int n, const int nchunks, F&& fn) {
+    if (nchunks<=1 || n<=1) { fn(0, n, 0); return; }
+    ThreadPool::instance().run(nchunks, nchunks, [&fn, n, nchunks](int c) {
+        fn(static_cast<long long>(n)*c/nchunks, static_cast<long long>(n)*(c+1)/nchunks, c);
+    });
+}
+
+// calls fn(i, thread) for every i in [0,n); items are handed out one by one so that the load stays balanced, thread is
+// in [0,nthreads) and no two calls with the same thread run at the same time
+template<class F>
+void parallel_for(const int n, const int nthreads, F&& fn) {
+    std::atomic<int> next{0};
+    auto worker = [&](int thread) {
+        for (int i; (i = next.fetch_add(1, std::memory_order_relaxed))<n; )
+            fn(i, thread);
+    };
+    int nworkers = std::min(nthreads, n);
+    if (nworkers<=1) { worker(0); return; }
+    ThreadPool::instance().run(nworkers, nworkers, worker);
+}
+
+#endif
@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include "profile.h"
+#include "tgaimage.h"
+
+namespace profile {
+    const char* stage_name(const Stage stage) {
+        static const char* names[nstages] = {"load", "vertex", "setup", "raster", "fragment", "output"};
+        return names[stage];
+    }
+
+#ifdef TINYRENDERER_PROFILE
+    namespace {
+        struct Slice { Stage stage; int track; double begin, end; };
+        std::mutex mutex;
+        std::vector<Slice> slices;
+        double total[nstages] = {};
+        double origin = 0;
+    }
+
+    void start() {
+        std::lock_guard<std::mutex> lock(mutex);
+        slices.clear();
+        std::fill(total, total+nstages, 0.);
+        origin = now();
+        enabled = true;
+    }
+
+    void start_heatmap(const int width, const int height) {
+        heatmap.assign(size_t(width)*height, 0);
+        heatmap_width = width;
+        heatmap_enabled = true;
+    }
+
+    void record(const Stage stage, const int track, const double begin, const double end) {
+        std::lock_guard<std::mutex> lock(mutex);
+        slices.push_back({stage, track, begin-origin, end-origin});
+        total[stage] += end-begin;
+        for (int s=0; s<nstages; s++) total[s] += nested[s];
+        std::fill(nested, nested+nstages, 0.);
+    }
+
+    void summary(std::ostream& out) {
+        if (!enabled) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        out << "stage times (summed over threads):";
+        for (int s=0; s<nstages; s++)
+            out << " " << stage_name(Stage(s)) << " " << total[s]/1e3 << "ms";
+        out << std::endl;
+    }
+
+    bool write_trace(const std::string& filename) {
+        std::ofstream out(filename);
+        if (!out.is_open()) {
+            std::cerr << "can't open file " << filename << std::endl;
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<int> tracks;
+        for (const Slice& s : slices) tracks.push_back(s.track);
+        std::sort(tracks.begin(), tracks.end());
+        tracks.erase(std::unique(tracks.begin(), tracks.end()), tracks.end());
+        out << "{\"traceEvents\":[\n";
+        for (int track : tracks) {
+            const std::string name = track==writer_track ? "frame writer" : track ? "worker " + std::to_string(track) : "main";
+            out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << track << ",\"args\":{\"name\":\"" << name << "\"}},\n";
+        }
+        out.precision(3);
+        out << std::fixed;
+        for (const Slice& s : slices)
+            out << "{\"name\":\"" << stage_name(s.stage) << "\",\"cat\":\"pipeline\",\"ph\":\"X\",\"pid\":1,\"tid\":" << s.track
+                << ",\"ts\":" << s.begin << ",\"dur\":" << s.end-s.begin << "},\n";
+        out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"tinyrenderer\"}}\n]}\n";
+        return out.good();
+    }
+
+    bool write_heatmap(const std::string& filename) {
+        if (!heatmap_enabled) return false;
+        const int w = heatmap_width, h = heatmap.size()/std::max(w, 1);
+        const std::uint32_t max = std::max<std::uint32_t>(1, *std::max_element(heatmap.begin(), heatmap.end()));
+        // black for no fragment, then blue, green, yellow and red for the most overdrawn pixels
+        const TGAColor ramp[5] = {TGAColor(0, 0, 0), TGAColor(255, 0, 0), TGAColor(0, 255, 0), TGAColor(0, 255, 255), TGAColor(0, 0, 255)};
+        TGAImage image(w, h, TGAImage::RGB);
+        for (int y=0; y<h; y++)
+            for (int x=0; x<w; x++) {
+                const std::uint32_t n = heatmap[x+y*w];
+                if (!n) continue;
+                const float t = 1 + 3.f*(n-1)/std::max<std::uint32_t>(1, max-1);
+                const int i = std::min(int(t), 3);
+                const float f = t-i;
+                TGAColor c;
+                for (int j=0; j<3; j++) c[j] = ramp[i].bgra[j] + (ramp[i+1].bgra[j] - ramp[i].bgra[j])*f;
+                image.set(x, y, c);
+            }
+        std::cerr << "overdraw: at most " << max << " fragments per pixel" << std::endl;
+        return image.write_tga_file(filename);
+    }
+#else
+    void start() {}
+    void start_heatmap(const int, const int) {}
+    void summary(std::ostream&) {}
+
+    bool write_trace(const std::string&) {
+        std::cerr << "built without TINYRENDERER_PROFILE, no trace recorded" << std::endl;
+        return false;
+    }
+
+    bool write_heatmap(const std::string&) {
+        std::cerr << "built without TINYRENDERER_PROFILE, no heatmap recorded" << std::endl;
+        return false;
+    }
+#endif
+}
@@ -0,0 +1,81 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// Pipeline instrumentation: wall time of the pipeline stages on every thread, exported as a Chrome trace (to be opened in
+// chrome://tracing or Perfetto), and an overdraw heatmap. The hooks compile away unless TINYRENDERER_PROFILE is defined;
+// when they are compiled in, nothing is recorded until start() or start_heatmap() is called.
+namespace profile {
+    enum Stage { Load, Vertex, Setup, Raster, Fragment, Output, nstages };
+    const char* stage_name(const Stage stage);
+
+    // trace tracks are the worker indices of the parallel loops, 0 being the calling thread
+    constexpr int writer_track = 1000; // background frame writer
+
+    void start();                                   // enables the stage timers
+    void start_heatmap(const int width, const int height);
+    void summary(std::ostream& out);                // total time per stage
+    bool write_trace(const std::string& filename);  // Chrome trace event format
+    bool write_heatmap(const std::string& filename); // fragments that passed the depth test per pixel, false color
+
+#ifdef TINYRENDERER_PROFILE
+    inline bool enabled = false;
+    inline bool heatmap_enabled = false;
+    inline std::vector<std::uint32_t> heatmap;
+    inline int heatmap_width = 0;
+
+    inline double now() { // microseconds
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    // time moved between the stages by the nested timers of the thread, merged into the totals by its next record()
+    inline thread_local double nested[nstages] = {};
+    void record(const Stage stage, const int track, const double begin, const double end);
+
+    // times its lifetime as a slice of the trace
+    struct Scope {
+        Stage stage;
+        int track;
+        double begin;
+        Scope(const Stage stage, const int track) : stage(stage), track(track), begin(enabled ? now() : 0) {}
+        ~Scope() { if (enabled) record(stage, track, begin, now()); }
+    };
+
+    // times its lifetime as a part of an enclosing slice, too short to get a slice of its own; no lock is taken, the
+    // time goes to the totals when the slice ends
+    struct Nested {
+        Stage stage, parent;
+        double begin;
+        Nested(const Stage stage, const Stage parent) : stage(stage), parent(parent), begin(enabled ? now() : 0) {}
+        ~Nested() {
+            if (!enabled) return;
+            const double duration = now()-begin;
+            nested[stage]  += duration;
+            nested[parent] -= duration;
+        }
+    };
+
+    // the pixels (x+k, y) of mask passed the depth test; tiles are disjoint between threads so no atomics are needed
+    inline void overdraw(const int x, const int y, const unsigned mask) {
+        std::uint32_t* row = heatmap.data() + x + y*heatmap_width;
+        for (int k=0; k<32 && (mask>>k); k++) row[k] += mask>>k & 1;
+    }
+#endif
+}
+
+#ifdef TINYRENDERER_PROFILE
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(stage, track) profile::Scope PROFILE_CONCAT(profile_scope_, __LINE__)(profile::stage, track)
+#define PROFILE_NESTED(stage, parent) profile::Nested PROFILE_CONCAT(profile_nested_, __LINE__)(profile::stage, profile::parent)
+#define PROFILE_OVERDRAW(x, y, mask) do { if (profile::heatmap_enabled) profile::overdraw(x, y, mask); } while (0)
+#else // the arguments are still referenced, so that the variables used only here stay used
+#define PROFILE_SCOPE(stage, track) (void)(track)
+#define PROFILE_NESTED(stage, parent)
+#define PROFILE_OVERDRAW(x, y, mask) do { (void)(x); (void)(y); (void)(mask); } while (0)
+#endif
+
+#endif
@@ -0,0 +1,189 @@
+#ifndef RASTER_H
+#define RASTER_H
+#include <algorithm>
+#include "geometry.h"
+#include "zbuffer.h"
+#include "profile.h"
+
+struct Rect { int xmin, ymin, xmax, ymax; }; // inclusive pixel bounds
+
+constexpr int subpixel_bits = 8; // vertices are snapped to 1/256 of a pixel
+constexpr long long subpixel_scale = 1ll<<subpixel_bits;
+constexpr double guard_band = 1<<16; // screen coordinates beyond it would overflow the fixed point edge functions
+constexpr real near_w = 1e-3f; // clip-space w of the near clipping plane
+
+// per-triangle rasterizer setup: the edge functions E_i(x,y) = a_i*x + b_i*y + c_i are evaluated at integer pixel
+// coordinates and are proportional to the screen-space barycentric coordinates
+struct Triangle {
+    int face;           // index of the face the triangle comes from
+    bool clipped;       // true if the clipper cut the face, the corners are then given by bar
+    vec3 bar[3];        // barycentric coordinates of the corners inside the face
+    long long a[3], b[3], c[3];
+    int threshold[3];   // a pixel is covered when E_i >= threshold_i for all i (top-left fill rule)
+    double invw[3];     // 1/w of the vertices for perspective-correct interpolation
+    double z[3];        // clip-space depth of the vertices
+    float zmax;         // no fragment of the triangle is closer than that
+    Rect bbox;          // covered pixels, clamped to the image
+};
+
+enum class CullMode { None, Back, Front }; // back faces are the ones that are clockwise on screen
+enum class Setup { Visible, Culled, Empty }; // Empty: degenerate or does not cover any pixel centre
+
+// computes the raster setup of a triangle whose vertices all lie in front of the eye and within the guard band,
+// viewport maps the normalized device coordinates to the pixels of the width x height image
+Setup setup_triangle(const vec4 clip_verts[3], const mat<4,4>& viewport, const int width, const int height, const CullMode cull, Triangle& tri);
+
+// floor and ceil of a/b for b>0
+inline long long floor_div(const long long a, const long long b) { return a>=0 ? a/b : -((-a+b-1)/b); }
+inline long long ceil_div (const long long a, const long long b) { return a>=0 ? (a+b-1)/b : -((-a)/b); }
+
+constexpr int block_size = DepthBuffer::tile; // pixels of a depth tile row that go through the depth test together
+
+// Evaluates a row of a depth tile, e holds the edge functions of its first pixel and zbuf points to its depth.
+// Fills the perspective-correct barycentrics and the depth of every pixel and returns the bit mask of the pixels
+// of the cover mask that pass the depth test. All the kernels give bit-identical results.
+typedef unsigned (*BlockKernel)(const Triangle& tri, const long long e[3], const unsigned cover, const float* zbuf, double bar[3][block_size], float depth[block_size]);
+
+enum class SimdLevel { Scalar, SSE41, AVX2 };
+
+SimdLevel simd_supported();             // best instruction set of this CPU
+bool set_simd_level(SimdLevel level);   // false if the CPU does not support it, the default is simd_supported()
+SimdLevel simd_level();
+const char* simd_name(SimdLevel level);
+BlockKernel block_kernel();
+
+// Depth-only kernel: same depth and test as the block kernels, but the depth of the pixels of the cover mask that pass is
+// written to zbuf directly and no barycentrics are stored. Returns the mask of the pixels that passed.
+typedef unsigned (*DepthKernel)(const Triangle& tri, const long long e[3], const unsigned cover, float* zbuf);
+DepthKernel depth_kernel();
+
+struct FragmentCounts {
+    long long tested = 0; // covered pixels, including the ones of the blocks rejected by the hierarchical depth test
+    long long passed = 0; // fragments that passed the depth test
+    long long kept = 0;   // fragments that were not discarded
+    FragmentCounts& operator+=(const FragmentCounts& c) { tested += c.tested; passed += c.passed; kept += c.kept; return *this; }
+};
+
+// Covered span [left[r], right[r]] of every row of the band of depth tiles starting at row by, from the half-planes
+// E_i(x) = row_i + a_i*(x-x0) >= threshold_i, row[r] being the edge functions at (x0, by+r). Returns false if the band is empty.
+inline bool band_spans(const Triangle& tri, const int xmin, const int xmax, const int ymin, const int ymax, const int x0, const int by,
+                       long long row[DepthBuffer::tile][3], int left[DepthBuffer::tile], int right[DepthBuffer::tile]) {
+    bool empty = true;
+    for (int r=0; r<DepthBuffer::tile; r++) {
+        const int y = by+r;
+        left[r] = xmin, right[r] = xmin-1;
+        if (y<ymin || y>ymax) continue;
+        long long l = xmin, rt = xmax;
+        for (int i=0; i<3; i++) {
+            row[r][i] = tri.a[i]*x0 + tri.b[i]*y + tri.c[i];
+            long long rhs = tri.threshold[i] - row[r][i];
+            if (tri.a[i]>0)      l  = std::max(l,  x0 + ceil_div ( rhs,  tri.a[i]));
+            else if (tri.a[i]<0) rt = std::min(rt, x0 + floor_div(-rhs, -tri.a[i]));
+            else if (rhs>0)      rt = l-1;
+        }
+        if (l>rt) continue; // empty span
+        left[r] = l, right[r] = rt;
+        empty = false;
+    }
+    return !empty;
+}
+
+// Walks the covered pixels of the triangle one depth tile row at a time and calls fragments(x, y, mask, bar) with the bit
+// mask of the pixels (x+k, y) that pass the depth test and their perspective-correct barycentrics bar[i][k]. fragments()
+// returns the mask of the fragments that were kept, their depth is written.
+template<class Fragments>
+FragmentCounts rasterize(const Triangle& tri, DepthBuffer& zbuffer, const Rect& scissor, Fragments&& fragments) {
+    constexpr int T = DepthBuffer::tile;
+    const int xmin = std::max(tri.bbox.xmin, scissor.xmin), xmax = std::min(tri.bbox.xmax, scissor.xmax);
+    const int ymin = std::max(tri.bbox.ymin, scissor.ymin), ymax = std::min(tri.bbox.ymax, scissor.ymax);
+    FragmentCounts counts;
+    if (xmin>xmax || ymin>ymax) return counts;
+
+    const BlockKernel kernel = block_kernel();
+    const int x0 = xmin/T*T; // the blocks are aligned on the depth tiles
+    for (int by=ymin/T*T; by<=ymax; by+=T) {
+        long long row[T][3];
+        int left[T], right[T];
+        if (!band_spans(tri, xmin, xmax, ymin, ymax, x0, by, row, left, right)) continue;
+
+        for (int bx=x0; bx<=xmax; bx+=T) {
+            for (int r=0; r<T; r++)
+                counts.tested += std::max(0, std::min(right[r], bx+T-1) - std::max(left[r], bx) + 1);
+            if (zbuffer.tile_min(bx, by) > tri.zmax) continue; // the whole block is hidden
+            bool written = false;
+            for (int r=0; r<T; r++) {
+                const int l = std::max(left[r], bx), rt = std::min(right[r], bx+T-1);
+                if (l>rt) continue;
+                const unsigned cover = ((2u<<(rt-bx))-1) & ~((1u<<(l-bx))-1);
+                long long e[3];
+                for (int i=0; i<3; i++) e[i] = row[r][i] + tri.a[i]*(bx-x0);
+                double bar[3][block_size];
+                float depth[block_size];
+                float* zrow = zbuffer.row(bx, by+r);
+                unsigned mask = kernel(tri, e, cover, zrow, bar, depth);
+                if (!mask) continue;
+                real bc_clip[3][block_size];
+                for (int i=0; i<3; i++)
+                    for (int k=0; k<block_size; k++) bc_clip[i][k] = static_cast<real>(bar[i][k]);
+                if (tri.clipped) // barycentrics inside the original face, clip-space interpolation is linear
+                    for (int k=0; k<block_size; k++) {
+                        real b[3] = {bc_clip[0][k], bc_clip[1][k], bc_clip[2][k]};
+                        for (int i=0; i<3; i++) bc_clip[i][k] = tri.bar[0][i]*b[0] + tri.bar[1][i]*b[1] + tri.bar[2][i]*b[2];
+                    }
+                PROFILE_OVERDRAW(bx, by+r, mask);
+                unsigned kept = fragments(bx, by+r, mask, bc_clip);
+                for (int k=0; k<block_size; k++) {
+                    counts.passed += mask>>k & 1;
+                    counts.kept   += kept>>k & 1;
+                }
+                for (int k=0; kept; k++, kept>>=1) {
+                    if (!(kept & 1)) continue;
+                    zrow[k] = depth[k];
+                    written = true;
+                }
+            }
+            if (written) zbuffer.update_tile(bx, by);
+        }
+    }
+    return counts;
+}
+
+// Depth-only rasterization for shadow maps and depth pre-passes: no barycentrics, no fragments and no color. The depth
+// written is bit-identical to the one of rasterize(), and its test passes on equal depth, so a color pass that follows a
+// pre-pass shades exactly the fragments that end up visible.
+inline FragmentCounts rasterize_depth(const Triangle& tri, DepthBuffer& zbuffer, const Rect& scissor) {
+    constexpr int T = DepthBuffer::tile;
+    const int xmin = std::max(tri.bbox.xmin, scissor.xmin), xmax = std::min(tri.bbox.xmax, scissor.xmax);
+    const int ymin = std::max(tri.bbox.ymin, scissor.ymin), ymax = std::min(tri.bbox.ymax, scissor.ymax);
+    FragmentCounts counts;
+    if (xmin>xmax || ymin>ymax) return counts;
+
+    const DepthKernel kernel = depth_kernel();
+    const int x0 = xmin/T*T;
+    for (int by=ymin/T*T; by<=ymax; by+=T) {
+        long long row[T][3];
+        int left[T], right[T];
+        if (!band_spans(tri, xmin, xmax, ymin, ymax, x0, by, row, left, right)) continue;
+        for (int bx=x0; bx<=xmax; bx+=T) {
+            for (int r=0; r<T; r++)
+                counts.tested += std::max(0, std::min(right[r], bx+T-1) - std::max(left[r], bx) + 1);
+            if (zbuffer.tile_min(bx, by) > tri.zmax) continue;
+            unsigned written = 0;
+            for (int r=0; r<T; r++) {
+                const int l = std::max(left[r], bx), rt = std::min(right[r], bx+T-1);
+                if (l>rt) continue;
+                const unsigned cover = ((2u<<(rt-bx))-1) & ~((1u<<(l-bx))-1);
+                long long e[3];
+                for (int i=0; i<3; i++) e[i] = row[r][i] + tri.a[i]*(bx-x0);
+                const unsigned mask = kernel(tri, e, cover, zbuffer.row(bx, by+r));
+                for (int k=0; k<block_size; k++) counts.passed += mask>>k & 1;
+                written |= mask;
+            }
+            if (written) zbuffer.update_tile(bx, by);
+        }
+    }
+    counts.kept = counts.passed;
+    return counts;
+}
+
+#endif
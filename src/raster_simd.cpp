@@ -0,0 +1,220 @@
+#include "raster.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RASTER_X86
+#define TARGET(isa) __attribute__((target(isa)))
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define RASTER_X86
+#define TARGET(isa)
+#include <intrin.h>
+#endif
+
+#ifdef RASTER_X86
+#include <immintrin.h>
+#endif
+
+// the depth is written out as (b0*z0 + b1*z1) + b2*z2 in every kernel so that they all round the same way,
+// it is rounded to float before the depth test
+static unsigned block_scalar(const Triangle& tri, const long long e[3], const unsigned cover, const float* zbuf, double bar[3][block_size], float depth[block_size]) {
+    unsigned mask = 0;
+    for (int k=0; k<block_size; k++) {
+        if (!(cover>>k & 1)) continue;
+        double q[3];
+        for (int i=0; i<3; i++) q[i] = static_cast<double>(e[i] + tri.a[i]*k)*tri.invw[i];
+        double s = q[0] + q[1] + q[2];
+        for (int i=0; i<3; i++) bar[i][k] = q[i]/s;
+        depth[k] = static_cast<float>(bar[0][k]*tri.z[0] + bar[1][k]*tri.z[1] + bar[2][k]*tri.z[2]);
+        if (!(zbuf[k] > depth[k])) mask |= 1u<<k;
+    }
+    return mask;
+}
+
+static unsigned depth_scalar(const Triangle& tri, const long long e[3], const unsigned cover, float* zbuf) {
+    unsigned mask = 0;
+    for (int k=0; k<block_size; k++) {
+        if (!(cover>>k & 1)) continue;
+        double q[3];
+        for (int i=0; i<3; i++) q[i] = static_cast<double>(e[i] + tri.a[i]*k)*tri.invw[i];
+        double s = q[0] + q[1] + q[2];
+        float depth = static_cast<float>(q[0]/s*tri.z[0] + q[1]/s*tri.z[1] + q[2]/s*tri.z[2]);
+        if (zbuf[k] > depth) continue;
+        zbuf[k] = depth;
+        mask |= 1u<<k;
+    }
+    return mask;
+}
+
+#ifdef RASTER_X86
+// the edge functions stay below 2^53 (see guard_band) so they are exact in double precision
+
+// the lanes outside of the cover mask are computed too, whatever they hold is masked out
+
+TARGET("sse4.1")
+static unsigned block_sse41(const Triangle& tri, const long long e[3], const unsigned cover, const float* zbuf, double bar[3][block_size], float depth[block_size]) {
+    __m128d e0[3], a[3], invw[3], z[3];
+    for (int i=0; i<3; i++) {
+        e0[i]   = _mm_set1_pd(static_cast<double>(e[i]));
+        a[i]    = _mm_set1_pd(static_cast<double>(tri.a[i]));
+        invw[i] = _mm_set1_pd(tri.invw[i]);
+        z[i]    = _mm_set1_pd(tri.z[i]);
+    }
+    unsigned mask = 0;
+    for (int k=0; k<block_size; k+=4) {
+        __m128 d4[2];
+        for (int h=0; h<2; h++) {
+            __m128d lane = _mm_set_pd(k+2*h+1, k+2*h);
+            __m128d q[3], b[3];
+            for (int i=0; i<3; i++) q[i] = _mm_mul_pd(_mm_add_pd(e0[i], _mm_mul_pd(a[i], lane)), invw[i]);
+            __m128d s = _mm_add_pd(_mm_add_pd(q[0], q[1]), q[2]);
+            for (int i=0; i<3; i++) _mm_storeu_pd(bar[i]+k+2*h, b[i] = _mm_div_pd(q[i], s));
+            d4[h] = _mm_cvtpd_ps(_mm_add_pd(_mm_add_pd(_mm_mul_pd(b[0], z[0]), _mm_mul_pd(b[1], z[1])), _mm_mul_pd(b[2], z[2])));
+        }
+        __m128 d = _mm_movelh_ps(d4[0], d4[1]);
+        _mm_storeu_ps(depth+k, d);
+        mask |= _mm_movemask_ps(_mm_cmpngt_ps(_mm_loadu_ps(zbuf+k), d)) << k;
+    }
+    return mask & cover;
+}
+
+// lanes k..k+3 of the cover mask as a vector mask
+TARGET("sse4.1")
+static inline __m128 cover_lanes(const unsigned cover, const int k) {
+    const __m128i bits = _mm_setr_epi32(1, 2, 4, 8);
+    return _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(cover>>k), bits), bits));
+}
+
+TARGET("sse4.1")
+static unsigned depth_sse41(const Triangle& tri, const long long e[3], const unsigned cover, float* zbuf) {
+    __m128d e0[3], a[3], invw[3], z[3];
+    for (int i=0; i<3; i++) {
+        e0[i]   = _mm_set1_pd(static_cast<double>(e[i]));
+        a[i]    = _mm_set1_pd(static_cast<double>(tri.a[i]));
+        invw[i] = _mm_set1_pd(tri.invw[i]);
+        z[i]    = _mm_set1_pd(tri.z[i]);
+    }
+    unsigned mask = 0;
+    for (int k=0; k<block_size; k+=4) {
+        if (!(cover>>k & 15)) continue;
+        __m128 d4[2];
+        for (int h=0; h<2; h++) {
+            __m128d lane = _mm_set_pd(k+2*h+1, k+2*h);
+            __m128d q[3];
+            for (int i=0; i<3; i++) q[i] = _mm_mul_pd(_mm_add_pd(e0[i], _mm_mul_pd(a[i], lane)), invw[i]);
+            __m128d s = _mm_add_pd(_mm_add_pd(q[0], q[1]), q[2]);
+            d4[h] = _mm_cvtpd_ps(_mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_div_pd(q[0], s), z[0]), _mm_mul_pd(_mm_div_pd(q[1], s), z[1])), _mm_mul_pd(_mm_div_pd(q[2], s), z[2])));
+        }
+        __m128 d = _mm_movelh_ps(d4[0], d4[1]);
+        __m128 zb = _mm_loadu_ps(zbuf+k);
+        __m128 pass = _mm_and_ps(_mm_cmpngt_ps(zb, d), cover_lanes(cover, k));
+        _mm_storeu_ps(zbuf+k, _mm_blendv_ps(zb, d, pass));
+        mask |= _mm_movemask_ps(pass) << k;
+    }
+    return mask;
+}
+
+TARGET("avx2")
+static unsigned block_avx2(const Triangle& tri, const long long e[3], const unsigned cover, const float* zbuf, double bar[3][block_size], float depth[block_size]) {
+    __m256d e0[3], a[3], invw[3], z[3];
+    for (int i=0; i<3; i++) {
+        e0[i]   = _mm256_set1_pd(static_cast<double>(e[i]));
+        a[i]    = _mm256_set1_pd(static_cast<double>(tri.a[i]));
+        invw[i] = _mm256_set1_pd(tri.invw[i]);
+        z[i]    = _mm256_set1_pd(tri.z[i]);
+    }
+    unsigned mask = 0;
+    for (int k=0; k<block_size; k+=4) {
+        __m256d lane = _mm256_set_pd(k+3, k+2, k+1, k);
+        __m256d q[3], b[3];
+        for (int i=0; i<3; i++) q[i] = _mm256_mul_pd(_mm256_add_pd(e0[i], _mm256_mul_pd(a[i], lane)), invw[i]);
+        __m256d s = _mm256_add_pd(_mm256_add_pd(q[0], q[1]), q[2]);
+        for (int i=0; i<3; i++) _mm256_storeu_pd(bar[i]+k, b[i] = _mm256_div_pd(q[i], s));
+        __m128 d = _mm256_cvtpd_ps(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(b[0], z[0]), _mm256_mul_pd(b[1], z[1])), _mm256_mul_pd(b[2], z[2])));
+        _mm_storeu_ps(depth+k, d);
+        mask |= _mm_movemask_ps(_mm_cmpngt_ps(_mm_loadu_ps(zbuf+k), d)) << k;
+    }
+    return mask & cover;
+}
+
+TARGET("avx2")
+static unsigned depth_avx2(const Triangle& tri, const long long e[3], const unsigned cover, float* zbuf) {
+    __m256d e0[3], a[3], invw[3], z[3];
+    for (int i=0; i<3; i++) {
+        e0[i]   = _mm256_set1_pd(static_cast<double>(e[i]));
+        a[i]    = _mm256_set1_pd(static_cast<double>(tri.a[i]));
+        invw[i] = _mm256_set1_pd(tri.invw[i]);
+        z[i]    = _mm256_set1_pd(tri.z[i]);
+    }
+    unsigned mask = 0;
+    for (int k=0; k<block_size; k+=4) {
+        if (!(cover>>k & 15)) continue;
+        __m256d lane = _mm256_set_pd(k+3, k+2, k+1, k);
+        __m256d q[3];
+        for (int i=0; i<3; i++) q[i] = _mm256_mul_pd(_mm256_add_pd(e0[i], _mm256_mul_pd(a[i], lane)), invw[i]);
+        __m256d s = _mm256_add_pd(_mm256_add_pd(q[0], q[1]), q[2]);
+        __m128 d = _mm256_cvtpd_ps(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_div_pd(q[0], s), z[0]), _mm256_mul_pd(_mm256_div_pd(q[1], s), z[1])), _mm256_mul_pd(_mm256_div_pd(q[2], s), z[2])));
+        __m128 zb = _mm_loadu_ps(zbuf+k);
+        __m128 pass = _mm_and_ps(_mm_cmpngt_ps(zb, d), cover_lanes(cover, k));
+        _mm_storeu_ps(zbuf+k, _mm_blendv_ps(zb, d, pass));
+        mask |= _mm_movemask_ps(pass) << k;
+    }
+    return mask;
+}
+#endif
+
+SimdLevel simd_supported() {
+#if defined(RASTER_X86) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))   return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return SimdLevel::SSE41;
+#elif defined(RASTER_X86)
+    int info[4];
+    __cpuid(info, 0);
+    int nids = info[0];
+    __cpuid(info, 1);
+    bool sse41 = info[2] & (1<<19), osxsave = info[2] & (1<<27), avx = info[2] & (1<<28);
+    bool avx2 = false;
+    if (nids>=7 && osxsave && avx && (_xgetbv(0) & 6)==6) {
+        __cpuidex(info, 7, 0);
+        avx2 = info[1] & (1<<5);
+    }
+    if (avx2)  return SimdLevel::AVX2;
+    if (sse41) return SimdLevel::SSE41;
+#endif
+    return SimdLevel::Scalar;
+}
+
+static SimdLevel current_level = simd_supported();
+
+bool set_simd_level(const SimdLevel level) {
+    if (level>simd_supported()) return false;
+    current_level = level;
+    return true;
+}
+
+SimdLevel simd_level() {
+    return current_level;
+}
+
+const char* simd_name(const SimdLevel level) {
+    switch (level) {
+        case SimdLevel::AVX2:  return "avx2";
+        case SimdLevel::SSE41: return "sse4.1";
+        default:               return "scalar";
+    }
+}
+
+BlockKernel block_kernel() {
+#ifdef RASTER_X86
+    if (current_level==SimdLevel::AVX2)  return block_avx2;
+    if (current_level==SimdLevel::SSE41) return block_sse41;
+#endif
+    return block_scalar;
+}
+
+DepthKernel depth_kernel() {
+#ifdef RASTER_X86
+    if (current_level==SimdLevel::AVX2)  return depth_avx2;
+    if (current_level==SimdLevel::SSE41) return depth_sse41;
+#endif
+    return depth_scalar;
+}
@@ -0,0 +1,180 @@
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+#include "render_server.h"
+#include "model_cache.h"
+#if defined(__unix__) || defined(__APPLE__)
+#include <csignal>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+namespace {
+
+// state shared by the accepting thread and the workers
+struct Server {
+    const RenderFunction& render;
+    ModelCache cache;
+    std::atomic<bool> stop{false};
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<int> queue; // accepted connections waiting for a worker
+    std::set<int> serving; // connections held by a worker
+    long long requests = 0, failed = 0;
+    double total_ms = 0;
+
+    Server(const RenderFunction& render, const ServerOptions& options) : render(render), cache(options.budget, options.use_cache) {}
+
+    std::string stats() {
+        const ModelCache::Stats c = cache.stats();
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ostringstream out;
+        out << "requests " << requests << " failed " << failed << " mean_ms " << (requests ? total_ms/requests : 0)
+            << " models " << c.models << " bytes " << c.bytes << " hits " << c.hits << " misses " << c.misses
+            << " evictions " << c.evictions << " hit_rate " << (c.hits+c.misses ? double(c.hits)/(c.hits+c.misses) : 0);
+        return out.str();
+    }
+
+    // parses and renders a render request, the reply line
+    std::string render_request(std::istringstream& args) {
+        const auto start = std::chrono::steady_clock::now();
+        RenderRequest req;
+        args >> req.model >> req.output >> req.width >> req.height;
+        for (vec3* v : {&req.eye, &req.center, &req.light})
+            for (int i=0; i<3; i++) args >> (*v)[i];
+        std::string error;
+        bool hit = false;
+        if (args.fail()) error = "expected model, output, width, height, eye, center and light";
+        else if (req.width<1 || req.height<1 || req.width>8192 || req.height>8192) error = "the image size must be within 1..8192";
+        else if (std::shared_ptr<const Model> model = cache.get(req.model, hit)) {
+            try {
+                error = render(req, model);
+            } catch (const std::exception& e) { // e.g. out of memory, the other requests go on
+                error = std::string("render failed: ") + e.what();
+            }
+        }
+        else error = "can't load " + req.model;
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requests++;
+            failed += !error.empty();
+            total_ms += ms;
+        }
+        std::ostringstream out;
+        if (error.empty()) out << "ok " << ms << (hit ? " hit" : " miss");
+        else out << "error " << error;
+        std::cerr << req.model + " -> " + req.output + ": " + out.str() + "\n" << std::flush; // one write, the workers log at once
+        return out.str();
+    }
+
+    // serves the requests of a connection until the client closes it
+    void connection(const int fd) {
+        std::string buffer;
+        char chunk[4096];
+        for (ssize_t n; (n = ::read(fd, chunk, sizeof(chunk)))>0; ) {
+            buffer.append(chunk, n);
+            for (size_t eol; (eol = buffer.find('\n'))!=std::string::npos; ) {
+                std::istringstream line(buffer.substr(0, eol));
+                buffer.erase(0, eol+1);
+                std::string command, reply;
+                if (!(line >> command)) continue;
+                if (command=="render") reply = render_request(line);
+                else if (command=="stats") reply = stats();
+                else if (command=="quit") { reply = "ok"; shutdown(); }
+                else reply = "error unknown command " + command;
+                reply += '\n';
+                for (size_t sent=0; sent<reply.size(); ) {
+                    ssize_t w = ::write(fd, reply.data()+sent, reply.size()-sent);
+                    if (w<=0) return;
+                    sent += w;
+                }
+            }
+        }
+    }
+
+    void worker() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cond.wait(lock, [this]() { return !queue.empty() || stop; });
+            if (queue.empty()) return;
+            const int fd = queue.front();
+            queue.pop_front();
+            serving.insert(fd);
+            lock.unlock();
+            connection(fd);
+            lock.lock();
+            serving.erase(fd);
+            ::close(fd);
+        }
+    }
+
+    // no more connections, the idle ones are closed and the ones in progress end after their current request
+    void shutdown() {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+        for (int fd : queue) ::close(fd);
+        queue.clear();
+        for (int fd : serving) ::shutdown(fd, SHUT_RD);
+        cond.notify_all();
+    }
+};
+
+}
+
+bool serve(const std::string& socket_path, const ServerOptions& options, const RenderFunction& render) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size()>=sizeof(addr.sun_path)) {
+        std::cerr << "socket path too long: " << socket_path << std::endl;
+        return false;
+    }
+    std::strcpy(addr.sun_path, socket_path.c_str());
+    const int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    ::unlink(socket_path.c_str()); // left over by a server that was killed
+    if (listener<0 || ::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))<0 || ::listen(listener, 64)<0) {
+        std::cerr << "can't listen on " << socket_path << ": " << std::strerror(errno) << std::endl;
+        if (listener>=0) ::close(listener);
+        return false;
+    }
+    std::signal(SIGPIPE, SIG_IGN); // a client that goes away fails the write of its reply instead
+    std::cerr << "listening on " << socket_path << " with " << options.workers << " workers" << std::endl;
+
+    Server server(render, options);
+    std::vector<std::thread> workers;
+    for (int i=0; i<std::max(1, options.workers); i++)
+        workers.emplace_back([&server]() { server.worker(); });
+    while (!server.stop) {
+        pollfd p = {listener, POLLIN, 0};
+        if (::poll(&p, 1, 200)<=0) continue; // wakes up now and then to see whether a client asked to quit
+        const int fd = ::accept(listener, nullptr, nullptr);
+        if (fd<0) continue;
+        std::lock_guard<std::mutex> lock(server.mutex);
+        if (server.stop) { ::close(fd); break; }
+        server.queue.push_back(fd);
+        server.cond.notify_one();
+    }
+    for (std::thread& t : workers) t.join();
+    ::close(listener);
+    ::unlink(socket_path.c_str());
+    std::cerr << server.stats() << std::endl;
+    return true;
+}
+#else
+bool serve(const std::string& socket_path, const ServerOptions&, const RenderFunction&) {
+    std::cerr << "can't listen on " << socket_path << ": the render server needs Unix domain sockets" << std::endl;
+    return false;
+}
+#endif
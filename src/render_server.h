@@ -0,0 +1,35 @@
+#ifndef RENDER_SERVER_H
+#define RENDER_SERVER_H
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include "geometry.h"
+#include "model.h"
+
+// a frame asked for by a client of the render server
+struct RenderRequest {
+    std::string model, output; // .obj file, .tga file
+    int width = 0, height = 0;
+    vec3 eye, center, light;
+};
+
+struct ServerOptions {
+    int workers = 4;              // connections served at the same time
+    std::size_t budget = 512<<20; // bytes of decoded models kept in memory
+    bool use_cache = true;        // of the .trmesh files
+};
+
+// renders a request with its model, returns the reason of the failure or an empty string
+typedef std::function<std::string(const RenderRequest& request, const std::shared_ptr<const Model>& model)> RenderFunction;
+
+// Long-running renderer listening on a Unix domain socket. The models stay decoded in a shared LRU cache between the
+// requests, a pool of workers serves the connections concurrently. Text protocol, one reply line per request line:
+//     render <model.obj> <output.tga> <width> <height> <eye x y z> <center x y z> <light x y z>
+//         -> ok <milliseconds> hit|miss    or    error <reason>
+//     stats -> requests <n> failed <n> mean_ms <t> models <n> bytes <n> hits <n> misses <n> evictions <n> hit_rate <r>
+//     quit  -> ok, the server stops once the connections in progress are closed
+// Returns false if the socket could not be opened.
+bool serve(const std::string& socket_path, const ServerOptions& options, const RenderFunction& render);
+
+#endif
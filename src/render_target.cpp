@@ -0,0 +1,69 @@
+#include <algorithm>
+#include "render_target.h"
+#include "raster.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RESOLVE_X86
+#define TARGET(isa) __attribute__((target(isa)))
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define RESOLVE_X86
+#define TARGET(isa)
+#include <intrin.h>
+#endif
+
+#ifdef RESOLVE_X86
+#include <immintrin.h>
+#endif
+
+RenderTarget::RenderTarget(const int w, const int h, const std::uint32_t value) : w(w), h(h), tiles_x((w+tile-1)/tile), tiles_y((h+tile-1)/tile),
+    pixels(tiles_x*tiles_y*tile*tile, value) {}
+
+void RenderTarget::clear(const std::uint32_t value) {
+    std::fill(pixels.begin(), pixels.end(), value);
+}
+
+TGAColor RenderTarget::get(const int x, const int y) const {
+    TGAColor c;
+    std::memcpy(c.bgra, &pixels[offset(x, y)], sizeof(c.bgra));
+    return c;
+}
+
+// converts n pixels to bpp bytes each
+static void resolve_scalar(const std::uint32_t* src, const int n, const int bpp, std::uint8_t* dst) {
+    if (bpp==4) { std::memcpy(dst, src, n*4); return; }
+    for (int i=0; i<n; i++)
+        std::memcpy(dst+i*bpp, src+i, bpp); // a pixel holds the bytes of a TGAColor, b,g,r come first
+}
+
+#ifdef RESOLVE_X86
+// a whole tile row of an RGB image: 8 pixels, 32 bytes in, 24 bytes out
+TARGET("sse4.1")
+static void resolve_rgb_sse41(const std::uint32_t* src, std::uint8_t* dst) {
+    const __m128i drop_alpha = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    __m128i lo = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src)),   drop_alpha);
+    __m128i hi = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src+4)), drop_alpha);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_or_si128(lo, _mm_slli_si128(hi, 12)));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst+16), _mm_srli_si128(hi, 4));
+}
+#endif
+
+void RenderTarget::resolve(TGAImage& image, const int nthreads) const {
+    if (image.width()!=w || image.height()!=h) image = TGAImage(w, h, TGAImage::RGB);
+    const int bpp = image.bytespp();
+#ifdef RESOLVE_X86
+    const bool vector = bpp==3 && simd_level()!=SimdLevel::Scalar;
+#endif
+    std::uint8_t* data = image.buffer();
+    parallel_chunks(h, std::max(1, std::min(nthreads, h/tile)), [&](int begin, int end, int) {
+        for (int y=begin; y<end; y++) {
+            std::uint8_t* dst = data + static_cast<size_t>(y)*w*bpp;
+            for (int x=0; x<w; x+=tile, dst+=tile*bpp) {
+                const int n = std::min(tile, w-x);
+#ifdef RESOLVE_X86
+                if (vector && n==tile) { resolve_rgb_sse41(row(x, y), dst); continue; }
+#endif
+                resolve_scalar(row(x, y), n, bpp, dst);
+            }
+        }
+    });
+}
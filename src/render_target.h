@@ -0,0 +1,46 @@
+#ifndef RENDER_TARGET_H
+#define RENDER_TARGET_H
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "tgaimage.h"
+#include "zbuffer.h"
+#include "parallel.h"
+
+// Color buffer the pipeline draws into: 32-bit pixels holding the bytes of a TGAColor (b,g,r,a), laid out in 8x8 tiles
+// like the depth buffer so that a tile row of fragments is one contiguous 32-byte line. There is no bounds check, the
+// rasterizer never writes outside of the image. resolve() converts it to a linear TGAImage when the frame is saved.
+class RenderTarget {
+public:
+    static constexpr int tile = DepthBuffer::tile;
+
+    RenderTarget() = default;
+    RenderTarget(const int w, const int h, const std::uint32_t value=0);
+    void clear(const std::uint32_t value=0);
+    int width()  const { return w; }
+    int height() const { return h; }
+
+    // pointer to the pixel (x,y), the rest of the tile row follows it
+    std::uint32_t* row(const int x, const int y) { return pixels.data() + offset(x, y); }
+    const std::uint32_t* row(const int x, const int y) const { return pixels.data() + offset(x, y); }
+    void set(const int x, const int y, const TGAColor& c) { pixels[offset(x, y)] = pack(c); }
+    TGAColor get(const int x, const int y) const;
+
+    static std::uint32_t pack(const TGAColor& c) {
+        std::uint32_t v;
+        std::memcpy(&v, c.bgra, sizeof(v));
+        return v;
+    }
+
+    // writes the pixels to a linear image, RGB and grayscale images keep the first 3 bytes or the first byte of a pixel;
+    // an image of another size is replaced by an RGB one
+    void resolve(TGAImage& image, const int nthreads=num_threads()) const;
+private:
+    int offset(const int x, const int y) const { return ((x/tile + y/tile*tiles_x)*tile + y%tile)*tile + x%tile; }
+
+    int w = 0, h = 0;
+    int tiles_x = 0, tiles_y = 0;
+    std::vector<std::uint32_t> pixels = {};
+};
+
+#endif
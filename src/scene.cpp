@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include "scene.h"
+#include "our_gl.h"
+
+int Scene::add_model(const std::string& filename, const bool use_cache) {
+    auto it = std::find(files.begin(), files.end(), filename);
+    if (it!=files.end() && !filename.empty()) return it-files.begin();
+    models.push_back(std::make_shared<const Model>(filename, use_cache));
+    files.push_back(filename);
+    return models.size()-1;
+}
+
+int Scene::add_model(std::shared_ptr<const Model> model) {
+    auto it = std::find(models.begin(), models.end(), model);
+    if (it!=models.end()) return it-models.begin();
+    models.push_back(std::move(model));
+    files.emplace_back();
+    return models.size()-1;
+}
+
+int Scene::add_instance(const int model, const mat<4,4>& transform) {
+    instances.push_back({model, transform});
+    Box box = Box::empty();
+    const Box& object = models[model]->bounds();
+    for (int i=0; i<8; i++) {
+        const vec4 p = transform*embed<4>(object.corner(i));
+        box.extend(proj<3>(p/p[3]));
+    }
+    boxes.push_back(box);
+    return instances.size()-1;
+}
+
+bool Scene::load(const std::string& filename, const bool use_cache) {
+    std::ifstream in(filename);
+    if (!in.is_open()) {
+        std::cerr << "can't open file " << filename << std::endl;
+        return false;
+    }
+    constexpr double pi = 3.14159265358979323846;
+    std::vector<int> ids; // models of the file in the scene
+    std::string line;
+    for (int nline=1; std::getline(in, line); nline++) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream iss(line);
+        std::string keyword;
+        if (!(iss >> keyword)) continue;
+        if (keyword=="model") {
+            std::string obj;
+            iss >> obj;
+            ids.push_back(add_model(obj, use_cache));
+            continue;
+        }
+        int m = -1;
+        vec3 pos;
+        real yaw = 0, scale = 1;
+        if (keyword=="instance" && iss >> m >> pos.x >> pos.y >> pos.z && m>=0 && m<(int)ids.size()) {
+            iss >> yaw >> scale;
+            const real a = yaw*pi/180, c = std::cos(a), s = std::sin(a);
+            mat<4,4> T = mat<4,4>::identity();
+            T[0][0] = c*scale, T[0][2] = s*scale, T[1][1] = scale, T[2][0] = -s*scale, T[2][2] = c*scale;
+            for (int i=0; i<3; i++) T[i][3] = pos[i];
+            add_instance(ids[m], T);
+            continue;
+        }
+        std::cerr << filename << ":" << nline << ": expected model <file> or instance <model> <x> <y> <z> [<yaw> [<scale>]]" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void Scene::build() {
+    order.resize(instances.size());
+    for (size_t i=0; i<order.size(); i++) order[i] = i;
+    nodes.clear();
+    if (!order.empty()) build_node(0, order.size());
+}
+
+// top-down, the instances are split at the median of their centers along the longest axis of the node
+int Scene::build_node(const int first, const int count) {
+    constexpr int leaf_size = 4;
+    const int index = nodes.size();
+    nodes.push_back({Box::empty(), first, count, -1});
+    Box box = Box::empty(), centers = Box::empty();
+    for (int i=first; i<first+count; i++) {
+        box.extend(boxes[order[i]]);
+        centers.extend((boxes[order[i]].min + boxes[order[i]].max)*.5);
+    }
+    nodes[index].box = box;
+    if (count<=leaf_size) return index;
+
+    const vec3 extent = centers.max - centers.min;
+    const int axis = extent.x>=extent.y && extent.x>=extent.z ? 0 : extent.y>=extent.z ? 1 : 2;
+    const int half = count/2;
+    std::nth_element(order.begin()+first, order.begin()+first+half, order.begin()+first+count, [&](int a, int b) {
+        return boxes[a].min[axis]+boxes[a].max[axis] < boxes[b].min[axis]+boxes[b].max[axis];
+    });
+    nodes[index].count = 0;
+    build_node(first, half);
+    const int right = build_node(first+half, count-half);
+    nodes[index].right = right;
+    return index;
+}
+
+void Scene::cull(const mat<4,4>& view_proj, const mat<4,4>& viewport, const int width, const int height, std::vector<int>& visible) const {
+    visible.clear();
+    if (nodes.empty()) return;
+    const Frustum frustum(viewport, width, height);
+    // outcodes of the box corners: outside if all of them are outside of the same plane, inside if none is outside
+    auto classify = [&](const Box& box, bool& inside) {
+        unsigned all = ~0u, any = 0;
+        for (int i=0; i<8; i++) {
+            const unsigned code = frustum.outcode(view_proj*embed<4>(box.corner(i)));
+            all &= code, any |= code;
+        }
+        inside = !any;
+        return !all;
+    };
+    std::vector<std::pair<int, bool>> stack = {{0, false}}; // node, known to be inside
+    while (!stack.empty()) {
+        auto [index, inside] = stack.back();
+        stack.pop_back();
+        const Node& node = nodes[index];
+        if (!inside && !classify(node.box, inside)) continue;
+        if (node.count) {
+            for (int i=node.first; i<node.first+node.count; i++) {
+                bool unused;
+                if (inside || classify(boxes[order[i]], unused)) visible.push_back(order[i]);
+            }
+            continue;
+        }
+        stack.push_back({node.right, inside});
+        stack.push_back({index+1, inside});
+    }
+    std::sort(visible.begin(), visible.end()); // draw in submission order
+}
@@ -0,0 +1,53 @@
+#ifndef SCENE_H
+#define SCENE_H
+#include <memory>
+#include <string>
+#include <vector>
+#include "geometry.h"
+#include "model.h"
+
+// a model of the scene placed in the world
+struct Instance {
+    int model;
+    mat<4,4> transform; // object to world coordinates
+};
+
+// Models shared by any number of instances, and a bounding volume hierarchy over the instances so that the ones lying
+// outside of the view frustum are culled before their vertex stage.
+class Scene {
+public:
+    // every file is loaded once, its instances share the vertices and the textures
+    int add_model(const std::string& filename, const bool use_cache=true);
+    // a model loaded elsewhere, e.g. by a cache shared with other scenes, that the scene keeps alive
+    int add_model(std::shared_ptr<const Model> model);
+    int add_instance(const int model, const mat<4,4>& transform);
+    // Scene file, one statement per line, empty lines and # comments are skipped:
+    //     model <file.obj>                                  the models are numbered from 0
+    //     instance <model> <x> <y> <z> [<yaw> [<scale>]]    yaw in degrees around the vertical axis
+    bool load(const std::string& filename, const bool use_cache=true);
+    void build(); // builds the hierarchy, once all the instances are added
+
+    int nmodels() const { return models.size(); }
+    int ninstances() const { return instances.size(); }
+    const Model& model(const int i) const { return *models[i]; }
+    const Instance& instance(const int i) const { return instances[i]; }
+    Box bounds() const { return nodes.empty() ? Box{} : nodes[0].box; } // of all the instances, once built
+
+    // instances whose bounding box may be seen through view_proj (world to clip coordinates), in increasing order
+    void cull(const mat<4,4>& view_proj, const mat<4,4>& viewport, const int width, const int height, std::vector<int>& visible) const;
+private:
+    struct Node {
+        Box box;
+        int first, count; // a leaf holds the instances order[first, first+count)
+        int right;        // inner nodes have count==0, their first child follows them and the second one is right
+    };
+    std::vector<std::shared_ptr<const Model>> models;
+    std::vector<std::string> files; // empty for the models added as is
+    std::vector<Instance> instances;
+    std::vector<Box> boxes; // world bounding box of every instance
+    std::vector<Node> nodes;
+    std::vector<int> order;
+    int build_node(const int first, const int count);
+};
+
+#endif
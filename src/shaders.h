@@ -0,0 +1,255 @@
+#ifndef SHADERS_H
+#define SHADERS_H
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "our_gl.h"
+#include "model.h"
+
+// Per-instance uniforms of the shaders, which do not read the global matrices so that every instance of a scene can have
+// its own transform
+struct Uniforms {
+    mat<4,4> M; // object to clip coordinates
+    vec3 light; // normalized light direction in object space
+
+    // view_proj: world to clip coordinates, object: object to world coordinates, light_dir: in world coordinates
+    Uniforms(const mat<4,4>& view_proj, const mat<4,4>& object, const vec3 light_dir)
+        : M(view_proj*object), light(proj<3>(object.inverse()*embed<4>(light_dir, 0)).normalized()) {}
+};
+
+// Simple shaders, the model and the uniforms are given to the constructor
+
+struct WarholShader {
+    const Model* model;
+    mat<4,4> M;             // object to clip coordinates
+    vec3 light;             // normalized light direction
+    struct Varyings {       // written by vertex and read by fragment shader
+        vec3 intensity;
+    } varyings;
+
+    WarholShader(const Model* model, const Uniforms& u) : model(model), M(u.M), light(u.light) {}
+
+    vec4 vertex(int iface, int nthvert) {
+        vec4 gl_Vertex = embed<4>(model->vert(iface, nthvert)); // read vert from .obj
+
+        gl_Vertex = M * gl_Vertex; // transform to clip coords
+        varyings.intensity[nthvert] = std::max<real>(0, model->normal(iface, nthvert)*light); // get diffuse lighting intensity
+        return gl_Vertex;
+    }
+
+    bool fragment(vec3 bar, TGAColor &color) {
+        real intensity = varyings.intensity*bar;
+        if (intensity>.85) intensity = 1;
+        else if (intensity>.60) intensity = .80;
+        else if (intensity>.45) intensity = .60;
+        else if (intensity>.30) intensity = .45;
+        else if (intensity>.15) intensity = .30;
+        else intensity = 0;
+        color = TGAColor(255, 155, 0)*intensity;
+        return false;
+    }
+};
+
+struct GouraudShader {
+    const Model* model;
+    mat<4,4> M;             // object to clip coordinates
+    vec3 light;             // normalized light direction
+    struct Varyings {       // written by vertex and read by fragment shader
+        vec3 intensity;
+    } varyings;
+
+    GouraudShader(const Model* model, const Uniforms& u) : model(model), M(u.M), light(u.light) {}
+
+    vec4 vertex(int iface, int nthvert) {
+        vec4 gl_Vertex = embed<4>(model->vert(iface, nthvert)); // read vert from .obj
+
+        gl_Vertex = M * gl_Vertex; // transform to clip coords
+        varyings.intensity[nthvert] = std::max<real>(0, model->normal(iface, nthvert)*light); // get diffuse lighting intensity
+        return gl_Vertex;
+    }
+
+    bool fragment(vec3 bar, TGAColor& color) {
+        real intensity = varyings.intensity * bar; // interpolates intensity
+        color = TGAColor(255, 255, 255) * intensity;
+        return false; // do not discard
+    }
+
+    // the interpolation is done for the whole block first, in the same order as the dot product above
+    unsigned fragments(const unsigned mask, const real bar[3][block_size], TGAColor color[block_size]) {
+        real intensity[block_size];
+        for (int k=0; k<block_size; k++)
+            intensity[k] = varyings.intensity[2]*bar[2][k] + varyings.intensity[1]*bar[1][k] + varyings.intensity[0]*bar[0][k];
+        for (int k=0; k<block_size; k++)
+            if (mask>>k & 1) color[k] = TGAColor(255, 255, 255) * intensity[k];
+        return mask;
+    }
+};
+
+struct TexShader {
+    const Model* model;
+    mat<4,4> M;             // object to clip coordinates
+    vec3 light;             // normalized light direction
+    struct Varyings {       // written by vertex and read by fragment shader
+        vec3 intensity;
+        mat<2,3> uv;
+    } varyings;
+
+    TexShader(const Model* model, const Uniforms& u) : model(model), M(u.M), light(u.light) {}
+
+    vec4 vertex(int iface, int nthvert) {
+        vec4 gl_Vertex = embed<4>(model->vert(iface, nthvert)); // read vert from .obj
+        gl_Vertex = M * gl_Vertex; // transform to clip coords
+        varyings.intensity[nthvert] = std::max<real>(0, model->normal(iface, nthvert)*light); // get diffuse lighting intensity
+        varyings.uv.set_col(nthvert, model->uv(iface, nthvert));
+        return gl_Vertex;
+    }
+
+    bool fragment(vec3 bar, TGAColor& color) {
+        real intensity = varyings.intensity * bar; // interpolates intensity
+        vec2 uv = varyings.uv * bar;
+        color = (model->diffuse(uv) * intensity);
+        return false; // do not discard
+    }
+};
+
+// x^e for x in [0,1] and e>=0 as 2^(e*log2(x)), with polynomial approximations of log2 and exp2 instead of std::pow().
+// The absolute error stays below 2e-3 for the exponents of the specular maps (0 to 255), the bench checks it.
+inline real fast_pow(const real x, const real e) {
+    if (!(x>0)) return e>0 ? 0 : 1;
+    // log2(x) = exponent + log2(mantissa), the mantissa m=1+t is in [1,2)
+    float f = static_cast<float>(x);
+    std::uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    const int exponent = static_cast<int>(bits>>23) - 127;
+    bits = (bits & 0x7fffff) | 0x3f800000;
+    std::memcpy(&f, &bits, sizeof(f));
+    const float t = f-1;
+    const float log2x = exponent + t*(1.4418359f + t*(-.70837224f + t*(.41355534f + t*(-.19126291f + t*.044243922f))));
+    // 2^y = 2^i * 2^r, i integer and r in [0,1)
+    const float y = static_cast<float>(e)*log2x;
+    if (y<-126) return 0;
+    const float i = std::floor(y), r = y-i;
+    const float p = 1 + r*(.69300488f + r*(.24153959f + r*(.051766094f + r*.013689432f)));
+    bits = static_cast<std::uint32_t>(static_cast<int>(i) + 127)<<23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return p*scale;
+}
+
+// Phong shading with the normal, diffuse and specular maps of the model and an optional shadow map. What is uniform
+// over a draw is computed once by the constructor, the fragments only read the textures and light.
+struct PhongShader {
+    static constexpr real shadow_bias = .02; // depth offset against self-shadowing, in world units
+
+    const Model* model = nullptr;
+    struct Varyings {
+        mat<2,3> uv;      // uv of the corners
+        vec4 clip[3];     // clip coordinates of the corners
+        Sampler sampler;  // texture filter, set once, and derivatives of the uv over the face
+    } varyings;
+    mat<4,4> uniform_M;   // object to clip coordinates
+    mat<4,4> uniform_viewport; // of the target, for the derivatives of the uv
+    mat<3,4> uniform_N;   // normal map to the normals the light works with: (Projection*ModelView).invert_transpose()
+                          // applied to the normal transform of the instance
+    vec3 uniform_l;       // light direction
+    mat<4,4> uniform_Mshadow;              // clip coordinates to the light space of the shadow map
+    mat<4,4> uniform_Vshadow;              // viewport of the shadow map
+    const DepthBuffer* shadowmap = nullptr; // no shadows if null
+    bool fast_specular = false;            // fast_pow() instead of std::pow()
+
+    PhongShader() = default;
+    // view_proj: world to clip coordinates, object: object to world coordinates, light_dir: in world coordinates
+    PhongShader(const Model* model, const mat<4,4>& viewport, const mat<4,4>& view_proj, const mat<4,4>& object, const vec3 light_dir)
+        : model(model), uniform_M(view_proj*object), uniform_viewport(viewport) {
+        mat<3,3> N; // the normals of the instance go through the inverse transpose of its linear part
+        for (int r=0; r<3; r++)
+            for (int c=0; c<3; c++) N[r][c] = object[r][c];
+        N = N.inverse_transpose();
+        const mat<4,4> MIT = view_proj.inverse_transpose();
+        for (int r=0; r<3; r++) {
+            for (int c=0; c<3; c++) uniform_N[r][c] = MIT[r][0]*N[0][c] + MIT[r][1]*N[1][c] + MIT[r][2]*N[2][c];
+            uniform_N[r][3] = MIT[r][3];
+        }
+        uniform_l = proj<3>(view_proj*embed<4>(light_dir)).normalized();
+    }
+
+    // indexed vertex stage: position of a vertex of the model, then the per-corner varyings
+    vec4 vertex(int ivert) const {
+        return uniform_M*embed<4>(model->vert(ivert));
+    }
+
+    void varying(int iface, int nthvert, const vec4& gl_Position) {
+        Varyings& v = varyings;
+        v.uv.set_col(nthvert, model->uv(iface, nthvert));
+        v.clip[nthvert] = gl_Position;
+        if (nthvert<2) return;
+        // the mip level is chosen per face, the derivatives of the uv are those of the screen-space affine mapping;
+        // faces crossing the eye plane have no such mapping and read the full resolution level
+        v.sampler.duvdx = v.sampler.duvdy = {0, 0};
+        if (std::min({v.clip[0][3], v.clip[1][3], v.clip[2][3]})<near_w) return;
+        vec2 uv[3], xy[3];
+        for (int j=0; j<3; j++) {
+            uv[j] = v.uv.col(j);
+            xy[j] = proj<2>(uniform_viewport*v.clip[j]/v.clip[j][3]);
+        }
+        uv_derivatives(uv, xy, v.sampler.duvdx, v.sampler.duvdy);
+    }
+
+    vec4 vertex(int iface, int nthvert) {
+        vec4 gl_Position = uniform_M*embed<4>(model->vert(iface, nthvert));
+        varying(iface, nthvert, gl_Position);
+        return gl_Position;
+    }
+
+    bool fragment(vec3 bar, TGAColor &color) {
+        shade(varyings.uv*bar, shadow(bar), color);
+        return false;
+    }
+
+    unsigned fragments(const unsigned mask, const real bar[3][block_size], TGAColor color[block_size]) {
+        for (int k=0; k<block_size; k++) {
+            if (!(mask>>k & 1)) continue;
+            const vec3 b{bar[0][k], bar[1][k], bar[2][k]};
+            shade(varyings.uv*b, shadow(b), color[k]);
+        }
+        return mask;
+    }
+
+    // clip coordinates of a point of the face
+    vec4 clip(const vec3 bar) const {
+        return varyings.clip[0]*bar[0] + varyings.clip[1]*bar[1] + varyings.clip[2]*bar[2];
+    }
+
+    // 1 if the point is lit, less if the shadow map holds something closer to the light
+    real shadow(const vec3 bar) const { return shadow(clip(bar)); }
+    real shadow(const vec4 clip) const {
+        if (!shadowmap) return 1;
+        vec4 p = uniform_Mshadow*clip;
+        p = p/p[3];
+        const int x = std::lround(uniform_Vshadow[0][0]*p[0] + uniform_Vshadow[0][3]);
+        const int y = std::lround(uniform_Vshadow[1][1]*p[1] + uniform_Vshadow[1][3]);
+        if (x<0 || y<0 || x>=shadowmap->width() || y>=shadowmap->height()) return 1;
+        return p[2] + shadow_bias >= shadowmap->get(x, y) ? 1 : .3;
+    }
+
+    vec3 normal(const vec2 uv) const {
+        return (uniform_N*embed<4>(model->normal(uv, varyings.sampler))).normalized();
+    }
+
+    void shade(const vec2 uv, const real shadow, TGAColor &color) const {
+        light(normal(uv), model->diffuse(uv, varyings.sampler), model->specular(uv, varyings.sampler), shadow, color);
+    }
+
+    // the lighting itself, once the textures are read: n normal, c diffuse color, e specular exponent
+    void light(const vec3 n, const TGAColor& c, const real e, const real shadow, TGAColor &color) const {
+        const vec3& l = uniform_l;
+        vec3 r = (n*(n*l*2.f) - l).normalized();   // reflected light
+        real spec = fast_specular ? fast_pow(std::max<real>(r[2], 0), e) : std::pow(std::max<real>(r[2], 0), e);
+        real diff = std::max<real>(0, n*l);
+        color = c;
+        for (int i=0; i<3; i++) color[i] = std::min<real>(5 + c.bgra[i]*shadow*(diff + .6f*spec), 255);
+    }
+};
+
+#endif
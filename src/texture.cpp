@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "texture.h"
+
+namespace {
+    // bits of a coordinate within a tile, spread to the even bits of the Morton index
+    constexpr int morton[Texture::tile] = {0, 1, 4, 5, 16, 17, 20, 21};
+
+    std::uint32_t pack(const TGAColor& c) {
+        std::uint32_t t;
+        std::memcpy(&t, c.bgra, 4);
+        return t;
+    }
+
+    TGAColor unpack(const std::uint32_t t) {
+        TGAColor c;
+        std::memcpy(c.bgra, &t, 4);
+        return c;
+    }
+
+    // std::floor() converted to int, without the library call
+    int ifloor(const real v) {
+        const int i = static_cast<int>(v);
+        return i - (v<i);
+    }
+
+    // repeat addressing, the coordinates are mostly inside the texture already and the division is skipped
+    int wrap(const int x, const int n) {
+        if (static_cast<unsigned>(x)<static_cast<unsigned>(n)) return x;
+        const int r = x%n;
+        return r<0 ? r+n : r;
+    }
+}
+
+void uv_derivatives(const vec2 uv[3], const vec2 xy[3], vec2& duvdx, vec2& duvdy) {
+    const vec2 e1 = xy[1]-xy[0], e2 = xy[2]-xy[0];
+    const vec2 t1 = uv[1]-uv[0], t2 = uv[2]-uv[0];
+    const real det = e1.x*e2.y - e1.y*e2.x;
+    if (std::abs(det)<1e-6f) { duvdx = duvdy = {0, 0}; return; }
+    // [t1 t2] = J*[e1 e2], the columns of J are the derivatives
+    duvdx = (t1*e2.y - t2*e1.y)/det;
+    duvdy = (t2*e1.x - t1*e2.x)/det;
+}
+
+std::vector<Texture::Level> Texture::layout(const int w, const int h) {
+    std::vector<Level> levels;
+    std::size_t offset = 0;
+    for (int lw=w, lh=h; ; lw=std::max(lw/2, 1), lh=std::max(lh/2, 1)) {
+        const int tiles_x = (lw+tile-1)/tile, tiles_y = (lh+tile-1)/tile;
+        levels.push_back({lw, lh, tiles_x, offset});
+        offset += std::size_t(tiles_x)*tiles_y*tile*tile;
+        if (lw==1 && lh==1) break;
+    }
+    return levels;
+}
+
+std::size_t Texture::storage_size(const int w, const int h) {
+    if (w<=0 || h<=0) return 0;
+    const Level last = layout(w, h).back();
+    return last.offset + tile*tile;
+}
+
+Texture::Texture(const TGAImage& image) : w(image.width()), h(image.height()) {
+    if (w<=0 || h<=0) { w = h = 0; return; }
+    level = layout(w, h);
+    storage.resize(storage_size(w, h), 0);
+    data = storage.data();
+    for (int y=0; y<h; y++)
+        for (int x=0; x<w; x++) {
+            TGAColor c = image.get(x, y);
+            for (int i=c.bytespp; i<4; i++) c[i] = 0;
+            storage[address(level[0], x, y)] = pack(c);
+        }
+    // every level is the 2x2 box filtered previous one, the last row or column is repeated for odd sizes
+    for (int l=1; l<levels(); l++) {
+        const Level &src = level[l-1], &dst = level[l];
+        for (int y=0; y<dst.h; y++)
+            for (int x=0; x<dst.w; x++) {
+                const int x0 = std::min(2*x, src.w-1), x1 = std::min(2*x+1, src.w-1);
+                const int y0 = std::min(2*y, src.h-1), y1 = std::min(2*y+1, src.h-1);
+                const TGAColor q[4] = {unpack(storage[address(src, x0, y0)]), unpack(storage[address(src, x1, y0)]),
+                                       unpack(storage[address(src, x0, y1)]), unpack(storage[address(src, x1, y1)])};
+                TGAColor c;
+                for (int i=0; i<4; i++) c[i] = (q[0].bgra[i] + q[1].bgra[i] + q[2].bgra[i] + q[3].bgra[i] + 2)/4;
+                storage[address(dst, x, y)] = pack(c);
+            }
+    }
+}
+
+Texture::Texture(const int w, const int h, const std::uint32_t* texels) : w(w), h(h), level(layout(w, h)), data(texels) {}
+
+Texture::Texture(const Texture& other) : w(other.w), h(other.h), level(other.level), storage(other.storage),
+    data(storage.empty() ? other.data : storage.data()) {}
+
+Texture& Texture::operator=(const Texture& other) {
+    if (this!=&other) {
+        w = other.w;
+        h = other.h;
+        level = other.level;
+        storage = other.storage;
+        data = storage.empty() ? other.data : storage.data();
+    }
+    return *this;
+}
+
+std::size_t Texture::address(const Level& l, const int x, const int y) {
+    return l.offset + (std::size_t(y/tile)*l.tiles_x + x/tile)*tile*tile + (morton[x%tile] | morton[y%tile]<<1);
+}
+
+TGAColor Texture::fetch(const int lod, const int x, const int y) const {
+    const Level& l = level[lod];
+    return unpack(data[address(l, wrap(x, l.w), wrap(y, l.h))]);
+}
+
+namespace {
+    // The level is the one where a pixel step covers about one texel along the longest derivative, rho2 is the squared
+    // length of that step in texels of the full resolution level. This is the definition, the samplers do not take
+    // the logarithm: they compare rho2 with the smallest footprint of every level, found once with this very function.
+    int mip_level(const real rho2) { return static_cast<int>(std::floor(std::log2(rho2)/2 + .5f)); }
+
+    struct MipThresholds {
+        real rho2[32]; // mip_level(x)>=k for x>=rho2[k]
+        MipThresholds() {
+            rho2[0] = 0;
+            for (int k=1; k<32; k++) {
+                real lo = std::ldexp(real(1), 2*k-2), hi = std::ldexp(real(1), 2*k); // mip_level(lo)<k<=mip_level(hi)
+                for (real mid; (mid = lo + (hi-lo)/2)>lo && mid<hi; )
+                    (mip_level(mid)>=k ? hi : lo) = mid;
+                rho2[k] = hi;
+            }
+        }
+    };
+}
+
+int Texture::lod(const int w, const int h, const int levels, const Sampler& sampler) {
+    const real rho2 = std::max(vec2{sampler.duvdx.x*w, sampler.duvdx.y*h}.norm2(), vec2{sampler.duvdy.x*w, sampler.duvdy.y*h}.norm2());
+    if (rho2<=1) return 0;
+    static const MipThresholds thresholds;
+    int lod = 0;
+    while (lod+1<levels && lod+1<32 && rho2>=thresholds.rho2[lod+1]) lod++;
+    return lod;
+}
+
+TGAColor Texture::sample(const vec2& uv, const Sampler& sampler) const {
+    if (empty()) return {};
+    const Level& l = level[lod(w, h, levels(), sampler)];
+    if (sampler.filter==Sampler::Nearest)
+        return unpack(data[address(l, wrap(ifloor(uv.x*l.w), l.w), wrap(ifloor(uv.y*l.h), l.h))]);
+
+    // texel centres are at half-integer coordinates, the footprint is wrapped once
+    const real s = uv.x*l.w - .5f, t = uv.y*l.h - .5f;
+    const int x = ifloor(s), y = ifloor(t);
+    const real fx = s-x, fy = t-y;
+    const int x0 = wrap(x, l.w), y0 = wrap(y, l.h), x1 = x0+1<l.w ? x0+1 : 0, y1 = y0+1<l.h ? y0+1 : 0;
+    const TGAColor q[4] = {unpack(data[address(l, x0, y0)]), unpack(data[address(l, x1, y0)]),
+                           unpack(data[address(l, x0, y1)]), unpack(data[address(l, x1, y1)])};
+    TGAColor c;
+    for (int i=0; i<4; i++) {
+        const real top = q[0].bgra[i] + (q[1].bgra[i] - q[0].bgra[i])*fx;
+        const real bot = q[2].bgra[i] + (q[3].bgra[i] - q[2].bgra[i])*fx;
+        c[i] = static_cast<std::uint8_t>(top + (bot-top)*fy + .5f);
+    }
+    return c;
+}
+
+NormalMap::NormalMap(const Texture& texture) : w(texture.w), h(texture.h), level(texture.level) {
+    if (texture.empty()) return;
+    texels.resize(Texture::storage_size(w, h), {0, 0, 0, 0});
+    for (int lod=0; lod<texture.levels(); lod++) {
+        const Texture::Level& l = level[lod];
+        for (int y=0; y<l.h; y++)
+            for (int x=0; x<l.w; x++) {
+                const TGAColor c = texture.fetch(lod, x, y);
+                std::int16_t v[3];
+                for (int i=0; i<3; i++) // same decoding as Model::normal()
+                    v[2-i] = static_cast<std::int16_t>(std::lround((c.bgra[i]/255.f*2.f - 1.f)*32767));
+                texels[Texture::address(l, x, y)] = {v[0], v[1], v[2], 0};
+            }
+    }
+}
+
+vec3 NormalMap::sample(const vec2& uv, const Sampler& sampler) const {
+    constexpr real scale = 1.f/32767;
+    if (empty()) return {-1, -1, -1}; // what Model::normal() decodes from a missing texture
+    const Texture::Level& l = level[Texture::lod(w, h, level.size(), sampler)];
+    if (sampler.filter==Sampler::Nearest)
+        return fetch(l, wrap(ifloor(uv.x*l.w), l.w), wrap(ifloor(uv.y*l.h), l.h))*scale;
+
+    const real s = uv.x*l.w - .5f, t = uv.y*l.h - .5f;
+    const int x = ifloor(s), y = ifloor(t);
+    const real fx = s-x, fy = t-y;
+    const int x0 = wrap(x, l.w), y0 = wrap(y, l.h), x1 = x0+1<l.w ? x0+1 : 0, y1 = y0+1<l.h ? y0+1 : 0;
+    const vec3 top = fetch(l, x0, y0) + (fetch(l, x1, y0) - fetch(l, x0, y0))*fx;
+    const vec3 bot = fetch(l, x0, y1) + (fetch(l, x1, y1) - fetch(l, x0, y1))*fx;
+    return (top + (bot-top)*fy)*scale;
+}
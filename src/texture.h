@@ -0,0 +1,80 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+#include <cstdint>
+#include <vector>
+#include "geometry.h"
+#include "tgaimage.h"
+
+// How a texture is read: the filter within a mip level, and the screen-space derivatives of the texture coordinates
+// that pick the level. Zero derivatives always read the full resolution level.
+struct Sampler {
+    enum Filter { Nearest, Bilinear };
+    Filter filter = Nearest;
+    vec2 duvdx = {0, 0};
+    vec2 duvdy = {0, 0};
+};
+
+// derivatives of the affine mapping from screen to texture coordinates defined by the three corners of a triangle
+void uv_derivatives(const vec2 uv[3], const vec2 xy[3], vec2& duvdx, vec2& duvdy);
+
+// Mipmapped texture with 4 bytes (BGRA) per texel and repeat addressing. Each level is made of 8x8 tiles stored one
+// after the other, the texels of a tile are in Morton (Z) order, so that a bilinear footprint or a small patch of
+// screen pixels touches a few cache lines only.
+class Texture {
+public:
+    static constexpr int tile = 8;
+
+    Texture() = default;
+    explicit Texture(const TGAImage& image);                   // builds the mip chain
+    Texture(const int w, const int h, const std::uint32_t* texels); // uses texels() of a texture of that size as is
+    // a copy of a texture owning its texels gets its own, one of borrowed texels shares them
+    Texture(const Texture& other);
+    Texture& operator=(const Texture& other);
+    Texture(Texture&&) = default; // the moved storage keeps its buffer, data stays valid
+    Texture& operator=(Texture&&) = default;
+    bool empty() const { return !w; }
+    int width()  const { return w; }
+    int height() const { return h; }
+    int levels() const { return level.size(); }
+
+    // all the levels, storage_size(w, h) texels
+    const std::uint32_t* texels() const { return data; }
+    static std::size_t storage_size(const int w, const int h);
+
+    TGAColor fetch(const int lod, const int x, const int y) const;
+    TGAColor sample(const vec2& uv, const Sampler& sampler={}) const;
+private:
+    friend class NormalMap; // same layout
+    struct Level { int w, h, tiles_x; std::size_t offset; };
+    static std::vector<Level> layout(const int w, const int h);
+    static std::size_t address(const Level& l, const int x, const int y);
+    static int lod(const int w, const int h, const int levels, const Sampler& sampler); // mip level the sampler reads
+
+    int w = 0, h = 0;
+    std::vector<Level> level = {};
+    std::vector<std::uint32_t> storage = {}; // empty when the texels are owned by someone else
+    const std::uint32_t* data = nullptr;
+};
+
+// Normal map decoded once: the texels of a texture turned into the vectors they encode, as 16-bit signed normalized
+// integers in the same tiles and mip chain. Sampling filters the vectors themselves, no texel is decoded per fragment.
+class NormalMap {
+public:
+    NormalMap() = default;
+    explicit NormalMap(const Texture& texture);
+    bool empty() const { return !w; }
+    std::size_t memory() const { return texels.size()*sizeof(Texel); }
+    vec3 sample(const vec2& uv, const Sampler& sampler={}) const; // filtering shortens the vectors
+private:
+    struct Texel { std::int16_t x, y, z, pad; };
+    vec3 fetch(const Texture::Level& l, const int x, const int y) const {
+        const Texel& t = texels[Texture::address(l, x, y)];
+        return {real(t.x), real(t.y), real(t.z)};
+    }
+
+    int w = 0, h = 0;
+    std::vector<Texture::Level> level = {};
+    std::vector<Texel> texels = {};
+};
+
+#endif
@@ -1,22 +1,26 @@
 #include <iostream>
 #include <cstring>
+#include <algorithm>
+#include <chrono>
 #include "tgaimage.h"
+#include "mapped_file.h"
+#include "parallel.h"
 
 TGAImage::TGAImage(const int w, const int h, const int bpp) : w(w), h(h), bpp(bpp), data(w*h*bpp, 0) {}
 
-bool TGAImage::read_tga_file(const std::string filename) {
-    std::ifstream in;
-    in.open(filename, std::ios::binary);
-    if (!in.is_open()) {
+bool TGAImage::read_tga_file(const std::string filename, const bool vflip) {
+    const auto start = std::chrono::steady_clock::now();
+    MappedFile file(filename);
+    if (!file.is_open()) {
         std::cerr << "can't open file " << filename << "\n";
         return false;
     }
     TGAHeader header;
-    in.read(reinterpret_cast<char *>(&header), sizeof(header));
-    if (!in.good()) {
+    if (file.size()<sizeof(header)) {
         std::cerr << "an error occured while reading the header\n";
         return false;
     }
+    std::memcpy(&header, file.data(), sizeof(header));
     w   = header.width;
     h   = header.height;
     bpp = header.bitsperpixel>>3;
@@ -24,16 +28,28 @@ bool TGAImage::read_tga_file(const std::string filename) {
         std::cerr << "bad bpp (or width/height) value\n";
         return false;
     }
-    size_t nbytes = bpp*w*h;
+    // the pixels follow the image id and the color map
+    const size_t skip = sizeof(header) + header.idlength + (header.colormaptype ? header.colormaplength*((header.colormapdepth+7)/8) : 0);
+    if (file.size()<skip) {
+        std::cerr << "an error occured while reading the data\n";
+        return false;
+    }
+    const std::uint8_t* in = reinterpret_cast<const std::uint8_t *>(file.data()) + skip;
+    const size_t insize = file.size() - skip;
+
+    // the rows are decoded straight to their final place: bottom-left origin files are stored upside down
+    const bool flip_rows = !(header.imagedescriptor & 0x20) != vflip;
+    const size_t nbytes = size_t(bpp)*w*h;
     data = std::vector<std::uint8_t>(nbytes, 0);
     if (3==header.datatypecode || 2==header.datatypecode) {
-        in.read(reinterpret_cast<char *>(data.data()), nbytes);
-        if (!in.good()) {
+        if (insize<nbytes) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
+        for (int y=0; y<h; y++)
+            std::memcpy(data.data() + size_t(flip_rows ? h-1-y : y)*w*bpp, in + size_t(y)*w*bpp, size_t(w)*bpp);
     } else if (10==header.datatypecode||11==header.datatypecode) {
-        if (!load_rle_data(in)) {
+        if (!load_rle_data(in, insize, flip_rows)) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
@@ -41,123 +57,113 @@ bool TGAImage::read_tga_file(const std::string filename) {
         std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
         return false;
     }
-    if (!(header.imagedescriptor & 0x20))
-        flip_vertically();
     if (header.imagedescriptor & 0x10)
         flip_horizontally();
-    std::cerr << w << "x" << h << "/" << bpp*8 << "\n";
+    tga_read_stats.files++;
+    tga_read_stats.bytes += nbytes;
+    tga_read_stats.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
     return true;
 }
 
-bool TGAImage::load_rle_data(std::ifstream &in) {
-    size_t pixelcount = w*h;
-    size_t currentpixel = 0;
-    size_t currentbyte  = 0;
-    TGAColor colorbuffer;
-    do {
-        std::uint8_t chunkheader = 0;
-        chunkheader = in.get();
-        if (!in.good()) {
-            std::cerr << "an error occured while reading the data\n";
-            return false;
-        }
-        if (chunkheader<128) {
-            chunkheader++;
-            for (int i=0; i<chunkheader; i++) {
-                in.read(reinterpret_cast<char *>(colorbuffer.bgra), bpp);
-                if (!in.good()) {
-                    std::cerr << "an error occured while reading the header\n";
-                    return false;
+bool TGAImage::load_rle_data(const std::uint8_t* in, const size_t size, const bool flip_rows) {
+    const size_t rowbytes = size_t(w)*bpp;
+    const std::uint8_t* end = in + size;
+    for (int y=0; y<h; y++) {
+        std::uint8_t* row = data.data() + (flip_rows ? h-1-y : y)*rowbytes;
+        // packets may run over several rows
+        for (size_t x=0; x<rowbytes; ) {
+            if (in>=end) return false;
+            const std::uint8_t chunkheader = *in++;
+            size_t n = ((chunkheader & 127) + 1)*size_t(bpp);
+            const bool run = chunkheader>=128;
+            if (in + (run ? bpp : n) > end) return false;
+            while (n) {
+                const size_t k = std::min(n, rowbytes-x);
+                if (run) { // the pixel is copied once, then the filled part doubles with every copy
+                    std::memcpy(row+x, in, bpp);
+                    for (size_t filled=bpp; filled<k; filled*=2)
+                        std::memcpy(row+x+filled, row+x, std::min(filled, k-filled));
+                } else {
+                    std::memcpy(row+x, in, k);
+                    in += k;
                 }
-                for (int t=0; t<bpp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
-            }
-        } else {
-            chunkheader -= 127;
-            in.read(reinterpret_cast<char *>(colorbuffer.bgra), bpp);
-            if (!in.good()) {
-                std::cerr << "an error occured while reading the header\n";
-                return false;
-            }
-            for (int i=0; i<chunkheader; i++) {
-                for (int t=0; t<bpp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
+                x += k;
+                n -= k;
+                if (n && x==rowbytes) {
+                    if (++y==h) {
+                        std::cerr << "Too many pixels read\n";
+                        return false;
+                    }
+                    row = data.data() + (flip_rows ? h-1-y : y)*rowbytes;
+                    x = 0;
                 }
             }
+            if (run) in += bpp;
         }
-    } while (currentpixel < pixelcount);
+    }
     return true;
 }
 
 bool TGAImage::write_tga_file(const std::string filename, const bool vflip, const bool rle) const {
-    constexpr std::uint8_t developer_area_ref[4] = {0, 0, 0, 0};
-    constexpr std::uint8_t extension_area_ref[4] = {0, 0, 0, 0};
-    constexpr std::uint8_t footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
+    const std::vector<std::uint8_t> file = encode_tga(vflip, rle);
     std::ofstream out;
     out.open(filename, std::ios::binary);
     if (!out.is_open()) {
         std::cerr << "can't open file " << filename << "\n";
         return false;
     }
+    out.write(reinterpret_cast<const char *>(file.data()), file.size());
+    if (!out.good()) {
+        std::cerr << "can't dump the tga file\n";
+        return false;
+    }
+    return true;
+}
+
+std::vector<std::uint8_t> TGAImage::encode_tga(const bool vflip, const bool rle) const {
+    constexpr std::uint8_t developer_area_ref[4] = {0, 0, 0, 0};
+    constexpr std::uint8_t extension_area_ref[4] = {0, 0, 0, 0};
+    constexpr std::uint8_t footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
+    constexpr int strip_rows = 16; // RLE packets never cross a strip, fixed strips keep the output independent of the thread count
     TGAHeader header = {};
     header.bitsperpixel = bpp<<3;
     header.width  = w;
     header.height = h;
     header.datatypecode = (bpp==GRAYSCALE?(rle?11:3):(rle?10:2));
     header.imagedescriptor = vflip ? 0x00 : 0x20; // top-left or bottom-left origin
-    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        return false;
-    }
-    if (!rle) {
-        out.write(reinterpret_cast<const char *>(data.data()), w*h*bpp);
-        if (!out.good()) {
-            std::cerr << "can't unload raw data\n";
-            return false;
+    std::vector<std::uint8_t> out(reinterpret_cast<const std::uint8_t *>(&header), reinterpret_cast<const std::uint8_t *>(&header+1));
+    if (!rle)
+        out.insert(out.end(), data.begin(), data.end());
+    else {
+        const int nstrips = (h+strip_rows-1)/strip_rows;
+        std::vector<std::vector<std::uint8_t>> strips(nstrips);
+        parallel_for(nstrips, num_threads(), [&](int i, int) {
+            unload_rle_data(size_t(i)*strip_rows*w, size_t(std::min((i+1)*strip_rows, h))*w, strips[i]);
+        });
+        size_t pos = out.size(), size = pos;
+        for (const auto& strip : strips) size += strip.size();
+        out.resize(size);
+        for (const auto& strip : strips) {
+            std::copy(strip.begin(), strip.end(), out.begin()+pos);
+            pos += strip.size();
         }
-    } else if (!unload_rle_data(out)) {
-            std::cerr << "can't unload rle data\n";
-            return false;
-        }
-    out.write(reinterpret_cast<const char *>(developer_area_ref), sizeof(developer_area_ref));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        return false;
-    }
-    out.write(reinterpret_cast<const char *>(extension_area_ref), sizeof(extension_area_ref));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        return false;
     }
-    out.write(reinterpret_cast<const char *>(footer), sizeof(footer));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        return false;
-    }
-    return true;
+    out.insert(out.end(), developer_area_ref, developer_area_ref+sizeof(developer_area_ref));
+    out.insert(out.end(), extension_area_ref, extension_area_ref+sizeof(extension_area_ref));
+    out.insert(out.end(), footer, footer+sizeof(footer));
+    return out;
 }
 
 // TODO: it is not necessary to break a raw chunk for two equal pixels (for the matter of the resulting size)
-bool TGAImage::unload_rle_data(std::ofstream &out) const {
+void TGAImage::unload_rle_data(const size_t begin, const size_t end, std::vector<std::uint8_t>& out) const {
     const std::uint8_t max_chunk_length = 128;
-    size_t npixels = w*h;
-    size_t curpix = 0;
-    while (curpix<npixels) {
+    size_t curpix = begin;
+    while (curpix<end) {
         size_t chunkstart = curpix*bpp;
         size_t curbyte = curpix*bpp;
         std::uint8_t run_length = 1;
         bool raw = true;
-        while (curpix+run_length<npixels && run_length<max_chunk_length) {
+        while (curpix+run_length<end && run_length<max_chunk_length) {
             bool succ_eq = true;
             for (int t=0; succ_eq && t<bpp; t++)
                 succ_eq = (data[curbyte+t]==data[curbyte+t+bpp]);
@@ -173,18 +179,9 @@ bool TGAImage::unload_rle_data(std::ofstream &out) const {
             run_length++;
         }
         curpix += run_length;
-        out.put(raw?run_length-1:run_length+127);
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
-        }
-        out.write(reinterpret_cast<const char *>(data.data()+chunkstart), (raw?run_length*bpp:bpp));
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
-        }
+        out.push_back(raw?run_length-1:run_length+127);
+        out.insert(out.end(), data.begin()+chunkstart, data.begin()+chunkstart+(raw?run_length*bpp:bpp));
     }
-    return true;
 }
 
 TGAColor TGAImage::get(const int x, const int y) const {
@@ -202,19 +199,21 @@ void TGAImage::set(int x, int y, const TGAColor &c) {
 }
 
 void TGAImage::flip_horizontally() {
-    int half = w>>1;
-    for (int i=0; i<half; i++)
-        for (int j=0; j<h; j++)
-            for (int b=0; b<bpp; b++)
-                std::swap(data[(i+j*w)*bpp+b], data[(w-1-i+j*w)*bpp+b]);
+    for (int j=0; j<h; j++) {
+        std::uint8_t* row = data.data() + size_t(j)*w*bpp;
+        for (int i=0, k=w-1; i<k; i++, k--)
+            std::swap_ranges(row+i*bpp, row+(i+1)*bpp, row+k*bpp);
+    }
 }
 
 void TGAImage::flip_vertically() {
-    int half = h>>1;
-    for (int i=0; i<w; i++)
-        for (int j=0; j<half; j++)
-            for (int b=0; b<bpp; b++)
-                std::swap(data[(i+j*w)*bpp+b], data[(i+(h-1-j)*w)*bpp+b]);
+    const size_t rowbytes = size_t(w)*bpp;
+    for (int j=0, k=h-1; j<k; j++, k--)
+        std::swap_ranges(data.begin()+j*rowbytes, data.begin()+(j+1)*rowbytes, data.begin()+k*rowbytes);
+}
+
+void TGAImage::clear() {
+    std::fill(data.begin(), data.end(), 0);
 }
 
 int TGAImage::width() const {
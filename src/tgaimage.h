@@ -1,9 +1,17 @@
 #ifndef TGAIMAGE_H
 #define TGAIMAGE_H
+#include <atomic>
 #include <cstdint>
 #include <fstream>
+#include <string>
 #include <vector>
 
+// totals of the successful read_tga_file() calls of the process, for the statistics of the CLI
+struct TGAReadStats {
+    std::atomic<long long> files{0}, bytes{0}, nanoseconds{0};
+};
+inline TGAReadStats tga_read_stats;
+
 #pragma pack(push,1)
 struct TGAHeader {
     std::uint8_t  idlength = 0;
@@ -44,17 +52,23 @@ struct TGAImage {
 
     TGAImage() = default;
     TGAImage(const int w, const int h, const int bpp);
-    bool  read_tga_file(const std::string filename);
+    bool  read_tga_file(const std::string filename, const bool vflip=false); // vflip: store the rows in reverse order
     bool write_tga_file(const std::string filename, const bool vflip=true, const bool rle=true) const;
+    // the whole .tga file in memory, strips of rows are RLE-compressed in parallel
+    std::vector<std::uint8_t> encode_tga(const bool vflip=true, const bool rle=true) const;
     void flip_horizontally();
     void flip_vertically();
     TGAColor get(const int x, const int y) const;
     void set(const int x, const int y, const TGAColor &c);
     int width()  const;
     int height() const;
+    int bytespp() const { return bpp; }
+    const std::uint8_t* buffer() const { return data.data(); }
+    std::uint8_t* buffer() { return data.data(); }
+    void clear();
 private:
-    bool   load_rle_data(std::ifstream &in);
-    bool unload_rle_data(std::ofstream &out) const;
+    bool   load_rle_data(const std::uint8_t* in, const size_t size, const bool flip_rows);
+    void unload_rle_data(const size_t begin, const size_t end, std::vector<std::uint8_t>& out) const;
 
     int w = 0;
     int h = 0;
@@ -0,0 +1,25 @@
+#include <algorithm>
+#include "zbuffer.h"
+
+DepthBuffer::DepthBuffer(const int w, const int h, const float value) : w(w), h(h), tiles_x((w+tile-1)/tile), tiles_y((h+tile-1)/tile),
+    depth(tiles_x*tiles_y*tile*tile, value), hiz(tiles_x*tiles_y, value) {}
+
+void DepthBuffer::clear(const float value) {
+    std::fill(depth.begin(), depth.end(), value);
+    std::fill(hiz.begin(), hiz.end(), value);
+}
+
+void DepthBuffer::set(const int x, const int y, const float z) {
+    depth[offset(x, y)] = z;
+    update_tile(x, y);
+}
+
+void DepthBuffer::update_tile(const int x, const int y) {
+    const float* t = depth.data() + (x/tile + y/tile*tiles_x)*tile*tile;
+    float m[tile];
+    std::copy(t, t+tile, m);
+    for (int i=tile; i<tile*tile; i+=tile)
+        for (int j=0; j<tile; j++)
+            m[j] = std::min(m[j], t[i+j]);
+    hiz[x/tile + y/tile*tiles_x] = *std::min_element(m, m+tile);
+}
@@ -0,0 +1,38 @@
+#ifndef ZBUFFER_H
+#define ZBUFFER_H
+#include <vector>
+#include <limits>
+
+// Depth buffer made of 8x8 tiles of 32-bit floats, a row of a tile is contiguous in memory.
+// Greater depth is closer to the camera. Every tile keeps the smallest depth it holds (hierarchical Z):
+// a fragment farther than that is hidden, so blocks and triangles entirely behind it can be skipped.
+class DepthBuffer {
+public:
+    static constexpr int tile = 8;
+
+    DepthBuffer() = default;
+    DepthBuffer(const int w, const int h, const float value=std::numeric_limits<float>::min());
+    void clear(const float value=std::numeric_limits<float>::min());
+    int width()  const { return w; }
+    int height() const { return h; }
+
+    // pointer to the depth of (x,y), the rest of the tile row follows it
+    float* row(const int x, const int y) { return depth.data() + offset(x, y); }
+    const float* row(const int x, const int y) const { return depth.data() + offset(x, y); }
+    float get(const int x, const int y) const { return depth[offset(x, y)]; }
+    void set(const int x, const int y, const float z);
+
+    // smallest depth of the tile containing (x,y), no fragment behind it can pass the depth test
+    float tile_min(const int x, const int y) const { return hiz[x/tile + y/tile*tiles_x]; }
+    // refreshes the hierarchical Z of the tile containing (x,y) after the tile has been written to
+    void update_tile(const int x, const int y);
+private:
+    int offset(const int x, const int y) const { return ((x/tile + y/tile*tiles_x)*tile + y%tile)*tile + x%tile; }
+
+    int w = 0, h = 0;
+    int tiles_x = 0, tiles_y = 0;
+    std::vector<float> depth = {};
+    std::vector<float> hiz = {};
+};
+
+#endif
@@ -0,0 +1,109 @@
+// Reorders the faces of an .obj mesh for the post-transform vertex cache, then roughly front-to-back from most
+// viewpoints to lower the overdraw, and writes it as a new .obj next to a copy of its textures. Prints the vertex cache
+// hit rates and the overdraw of every order; a pass that makes things worse is not kept.
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "meshopt.h"
+#include "model.h"
+
+namespace fs = std::filesystem;
+
+struct OrderStats {
+    double acmr;     // FIFO32
+    double overdraw;
+};
+
+static OrderStats report(const char* title, const Model& model, const std::vector<int>& order) {
+    OrderStats stats;
+    std::cerr << title << ":";
+    for (int size : {16, 32}) {
+        const VertexCacheStats s = simulate_vertex_cache(model.vert_indices(), order, model.nverts(), size);
+        std::cerr << " FIFO" << size << " hit rate " << s.hit_rate*100 << "% ACMR " << s.acmr << " ATVR " << s.atvr << ",";
+        stats.acmr = s.acmr;
+    }
+    stats.overdraw = measure_overdraw(model.vert_indices(), model.positions().data(), model.nfaces(), model.nverts(), order);
+    std::cerr << " overdraw " << stats.overdraw << std::endl;
+    return stats;
+}
+
+static bool write_obj(const std::string& filename, const Model& model, const std::vector<int>& order) {
+    std::ofstream out(filename);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << filename << std::endl;
+        return false;
+    }
+    out.precision(9); // round trips a float
+    for (size_t i=0; i<model.positions().size(); i++) {
+        const vec3 v = model.positions()[i];
+        out << "v " << v.x << " " << v.y << " " << v.z << "\n";
+    }
+    for (size_t i=0; i<model.texcoords().size(); i++) {
+        const vec2 t = model.texcoords()[i];
+        out << "vt " << t.x << " " << t.y << "\n";
+    }
+    for (size_t i=0; i<model.normals().size(); i++) {
+        const vec3 n = model.normals()[i];
+        out << "vn " << n.x << " " << n.y << " " << n.z << "\n";
+    }
+    const std::vector<int> v = reorder_faces(model.vert_indices(), order);
+    const std::vector<int> t = reorder_faces(model.tex_indices(), order);
+    const std::vector<int> n = reorder_faces(model.norm_indices(), order);
+    for (size_t f=0; f<order.size(); f++) {
+        out << "f";
+        for (int j=0; j<3; j++) out << " " << v[f*3+j]+1 << "/" << t[f*3+j]+1 << "/" << n[f*3+j]+1;
+        out << "\n";
+    }
+    return out.good();
+}
+
+int main(int argc, char** argv) {
+    const char* files[2] = {nullptr, nullptr};
+    double threshold = 1.05;
+    bool overdraw = true;
+    int nfiles = 0;
+    for (int i=1; i<argc; i++) {
+        if (!strcmp(argv[i], "-threshold") && i+1<argc) threshold = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-nooverdraw")) overdraw = false;
+        else if (nfiles<2) files[nfiles++] = argv[i];
+    }
+    if (nfiles<2) {
+        std::cerr << "usage: " << argv[0] << " [-threshold 1.05] [-nooverdraw] input.obj output.obj" << std::endl;
+        return 1;
+    }
+    const Model model(files[0], false);
+    if (!model.nfaces()) return 1;
+
+    // the vertex cache order replaces the input one if it saves vertex shading; the overdraw order replaces it only if
+    // its overdraw is lower than the one of both other orders, otherwise it costs vertex shading for nothing
+    std::vector<int> order(model.nfaces());
+    for (int f=0; f<model.nfaces(); f++) order[f] = f;
+    const char* kept = "input";
+    const OrderStats input = report("before", model, order);
+    std::vector<int> cache_order = optimize_vertex_cache(model.vert_indices(), model.nfaces(), model.nverts());
+    const OrderStats cached = report("vertex cache", model, cache_order);
+    if (cached.acmr<input.acmr) order = cache_order, kept = "vertex cache";
+    if (overdraw) {
+        std::vector<int> overdraw_order = optimize_overdraw(model.vert_indices(), model.positions().data(), model.nfaces(), model.nverts(), cache_order, threshold);
+        const OrderStats sorted = report("overdraw", model, overdraw_order);
+        if (sorted.overdraw<std::min(input.overdraw, cached.overdraw) && sorted.acmr<input.acmr) order = overdraw_order, kept = "overdraw";
+    }
+    std::cerr << "keeping the " << kept << " order" << std::endl;
+    if (!write_obj(files[1], model, order)) return 1;
+
+    // the textures follow the naming of the model
+    const fs::path in(files[0]), out(files[1]);
+    for (const char* suffix : {"_diffuse.tga", "_nm_tangent.tga", "_spec.tga"}) {
+        const fs::path src = in.parent_path()/(in.stem().string() + suffix), dst = out.parent_path()/(out.stem().string() + suffix);
+        std::error_code error;
+        if (fs::exists(src) && !fs::equivalent(src, dst, error))
+            fs::copy_file(src, dst, fs::copy_options::overwrite_existing, error);
+        if (error) std::cerr << "can't copy " << src << " to " << dst << ": " << error.message() << std::endl;
+    }
+    return 0;
+}